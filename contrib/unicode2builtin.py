@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+#
+# Generates src/unicode.cc, the code point ranges behind the utf8_* builtin
+# machines. The ranges come from the Unicode database that ships with the
+# running Python, so regenerate with a newer Python to move to a newer
+# version of Unicode.
+#
+# Usage: unicode2builtin.py > ../src/unicode.cc
+#
+
+import sys
+import unicodedata
+
+MAX_CODE_POINT = 0x10FFFF
+
+# White_Space is a property, not a category. It is the space separators plus
+# these.
+WHITE_SPACE_EXTRA = set( [ 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x85, 0x2028, 0x2029 ] )
+
+CLASSES = [
+	( "unicodeLetter", "letters (L)",
+		lambda c, cat: cat[0] == 'L' ),
+	( "unicodeUpper", "upper case letters (Lu)",
+		lambda c, cat: cat == 'Lu' ),
+	( "unicodeLower", "lower case letters (Ll)",
+		lambda c, cat: cat == 'Ll' ),
+	( "unicodeDigit", "decimal digits (Nd)",
+		lambda c, cat: cat == 'Nd' ),
+	( "unicodeAlnum", "letters and decimal digits (L, Nd)",
+		lambda c, cat: cat[0] == 'L' or cat == 'Nd' ),
+	( "unicodeSpace", "white space (White_Space)",
+		lambda c, cat: cat == 'Zs' or c in WHITE_SPACE_EXTRA ),
+]
+
+def ranges( pred ):
+	result = []
+	low = None
+	for c in range( MAX_CODE_POINT + 2 ):
+		inside = False
+		if c <= MAX_CODE_POINT:
+			inside = pred( c, unicodedata.category( chr( c ) ) )
+
+		if inside and low is None:
+			low = c
+		elif not inside and low is not None:
+			result.append( ( low, c - 1 ) )
+			low = None
+	return result
+
+out = sys.stdout
+
+out.write( "/*\n" )
+out.write( " * Generated by contrib/unicode2builtin.py from Unicode %s.\n" %
+		unicodedata.unidata_version )
+out.write( " * Do not edit.\n" )
+out.write( " */\n" )
+out.write( "\n" )
+out.write( "#include \"parsetree.h\"\n" )
+
+for name, desc, pred in CLASSES:
+	rs = ranges( pred )
+
+	out.write( "\n" )
+	out.write( "/* Unicode %s. */\n" % desc )
+	out.write( "const UnicodeRange %s[] = {\n" % name )
+	for i in range( 0, len( rs ), 3 ):
+		row = ", ".join( "{ 0x%04X, 0x%04X }" % r for r in rs[i:i+3] )
+		out.write( "\t%s%s\n" % ( row, "," if i + 3 < len( rs ) else "" ) )
+	out.write( "};\n" )
+	out.write( "const long %sLen = %d;\n" % ( name, len( rs ) ) )
@@ -0,0 +1,372 @@
+/*
+ * Copyright 2018 Adrian Thurston <thurston@colm.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Batch compilation. Many input files are compiled by one invocation, either
+ * listed on the command line or one per line of a manifest:
+ *
+ *     # input file, then options for that file only
+ *     lexer.rl -o lexer.c
+ *     parser.rl -G2 -o parser.c
+ *
+ * Blank lines and lines starting with '#' are ignored. The options given on
+ * the command line apply to every entry, followed by the entry's own.
+ *
+ * Each entry runs as a job forked from this process, so the program is loaded
+ * and initialized once, and every entry starts from clean compiler state. Up
+ * to --jobs entries run at a time. Diagnostics are tagged with the entry's
+ * input file, a line at a time, so output from concurrent jobs stays readable.
+ */
+
+#include <libfsm/ragel.h>
+#include "inputdata.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(HAVE_SYS_WAIT_H)
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+using std::string;
+using std::endl;
+
+struct BatchEntry
+{
+	string label;
+	std::vector<string> args;
+};
+
+static void splitWords( const char *p, const char *pe, std::vector<string> &words )
+{
+	while ( p < pe ) {
+		while ( p < pe && ( *p == ' ' || *p == '\t' || *p == '\r' ) )
+			p += 1;
+
+		const char *start = p;
+		while ( p < pe && *p != ' ' && *p != '\t' && *p != '\r' )
+			p += 1;
+
+		if ( p > start )
+			words.push_back( string( start, p - start ) );
+	}
+}
+
+/* Run one entry in this process on fresh compiler state. */
+int InputData::runBatchEntry( IdProcess entry, const std::vector<string> &args )
+{
+	std::vector<const char*> argv;
+	for ( size_t i = 0; i < args.size(); i++ )
+		argv.push_back( args[i].c_str() );
+	argv.push_back( 0 );
+
+	InputData *id = new InputData( hostLang, frontendSections, rlhcSections );
+	int code = (id->*entry)( argv.size() - 1, &argv[0] );
+	delete id;
+
+	return code;
+}
+
+#if defined(HAVE_SYS_WAIT_H)
+
+struct BatchJob
+{
+	string label;
+	pid_t pid;
+	int fd[2];
+	string pending[2];
+};
+
+/* Write out the complete lines of a job's output, or everything once the
+ * stream has closed. Diagnostics get the job's tag. */
+static void relayLines( BatchJob &job, int f, bool all )
+{
+	string &p = job.pending[f];
+	size_t start = 0;
+	while ( start < p.size() ) {
+		size_t nl = p.find( '\n', start );
+		if ( nl == string::npos && !all )
+			break;
+
+		size_t end = nl == string::npos ? p.size() : nl;
+		if ( f == 0 )
+			std::cout << p.substr( start, end - start ) << '\n';
+		else
+			std::cerr << '[' << job.label << "] " << p.substr( start, end - start ) << '\n';
+
+		start = end + 1;
+	}
+
+	p.erase( 0, start < p.size() ? start : p.size() );
+}
+
+static int runBatchJobs( InputData *id, InputData::IdProcess entry,
+		std::vector<BatchEntry> &entries, long jobs )
+{
+	std::vector<BatchJob> running;
+	size_t next = 0;
+	long failed = 0;
+
+	while ( next < entries.size() || running.size() > 0 ) {
+		/* Fill the pool. */
+		while ( (long)running.size() < jobs && next < entries.size() ) {
+			BatchEntry &be = entries[next++];
+
+			int out[2], err[2];
+			if ( pipe( out ) != 0 || pipe( err ) != 0 ) {
+				std::cerr << '[' << be.label << "] could not create pipes: " <<
+						strerror(errno) << endl;
+				failed += 1;
+				continue;
+			}
+
+			std::cout.flush();
+			std::cerr.flush();
+
+			pid_t pid = fork();
+			if ( pid == 0 ) {
+				for ( size_t j = 0; j < running.size(); j++ ) {
+					if ( running[j].fd[0] >= 0 )
+						close( running[j].fd[0] );
+					if ( running[j].fd[1] >= 0 )
+						close( running[j].fd[1] );
+				}
+
+				close( out[0] );
+				close( err[0] );
+				dup2( out[1], 1 );
+				dup2( err[1], 2 );
+				close( out[1] );
+				close( err[1] );
+
+				int code = id->runBatchEntry( entry, be.args );
+
+				std::cout.flush();
+				std::cerr.flush();
+				exit( code );
+			}
+
+			close( out[1] );
+			close( err[1] );
+
+			if ( pid < 0 ) {
+				std::cerr << '[' << be.label << "] could not fork: " <<
+						strerror(errno) << endl;
+				close( out[0] );
+				close( err[0] );
+				failed += 1;
+				continue;
+			}
+
+			BatchJob job;
+			job.label = be.label;
+			job.pid = pid;
+			job.fd[0] = out[0];
+			job.fd[1] = err[0];
+			running.push_back( job );
+		}
+
+		if ( running.size() == 0 )
+			break;
+
+		/* Wait for output from any job. */
+		std::vector<struct pollfd> fds;
+		std::vector<size_t> owner;
+		for ( size_t j = 0; j < running.size(); j++ ) {
+			for ( int f = 0; f < 2; f++ ) {
+				if ( running[j].fd[f] >= 0 ) {
+					struct pollfd pfd;
+					pfd.fd = running[j].fd[f];
+					pfd.events = POLLIN;
+					pfd.revents = 0;
+					fds.push_back( pfd );
+					owner.push_back( j * 2 + f );
+				}
+			}
+		}
+
+		if ( fds.size() > 0 && poll( &fds[0], fds.size(), -1 ) < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			error() << "batch: poll failed: " << strerror(errno) << endp;
+		}
+
+		for ( size_t i = 0; i < fds.size(); i++ ) {
+			if ( fds[i].revents == 0 )
+				continue;
+
+			BatchJob &job = running[owner[i] / 2];
+			int f = owner[i] % 2;
+
+			char buf[8192];
+			ssize_t n = read( job.fd[f], buf, sizeof(buf) );
+			if ( n < 0 && errno == EINTR )
+				continue;
+
+			if ( n <= 0 ) {
+				relayLines( job, f, true );
+				close( job.fd[f] );
+				job.fd[f] = -1;
+			}
+			else {
+				job.pending[f].append( buf, n );
+				relayLines( job, f, false );
+			}
+		}
+
+		/* Reap the jobs whose output has closed. */
+		for ( size_t j = 0; j < running.size(); ) {
+			BatchJob &job = running[j];
+			if ( job.fd[0] >= 0 || job.fd[1] >= 0 ) {
+				j += 1;
+				continue;
+			}
+
+			int status = 0;
+			waitpid( job.pid, &status, 0 );
+			if ( WIFSIGNALED( status ) ) {
+				std::cerr << '[' << job.label << "] stopped by signal: " <<
+						WTERMSIG( status ) << endl;
+				failed += 1;
+			}
+			else if ( WEXITSTATUS( status ) != 0 ) {
+				failed += 1;
+			}
+
+			running.erase( running.begin() + j );
+		}
+	}
+
+	std::cout.flush();
+
+	if ( failed > 0 ) {
+		std::cerr << "ragel: " << failed << " of " << entries.size() <<
+				" batch entries failed" << endl;
+	}
+
+	return failed > 0 ? 1 : 0;
+}
+
+#else
+
+static int runBatchJobs( InputData *id, InputData::IdProcess entry,
+		std::vector<BatchEntry> &entries, long jobs )
+{
+	int code = 0;
+	for ( size_t i = 0; i < entries.size(); i++ ) {
+		if ( id->runBatchEntry( entry, entries[i].args ) != 0 )
+			code = 1;
+	}
+	return code;
+}
+
+#endif
+
+int InputData::runBatch( int argc, const char **argv, IdProcess entry )
+{
+	/* Bail on argument processing errors. */
+	if ( errorCount > 0 )
+		abortCompile( 1 );
+
+	if ( outputFileName != 0 ) {
+		error() << "-o cannot be shared by a batch, "
+				"give each manifest entry its own" << endp;
+	}
+
+	/* Arguments common to every entry: all but the input files, the
+	 * manifest and the job count, which is the batch's own. */
+	std::vector<string> common;
+	for ( int i = 1; i < argc; i++ ) {
+		bool isInput = false;
+		for ( size_t j = 0; j < inputArgs.size(); j++ ) {
+			if ( inputArgs[j] == i )
+				isInput = true;
+		}
+
+		if ( isInput || strncmp( argv[i], "--batch=", 8 ) == 0 ||
+				strcmp( argv[i], "--jobs" ) == 0 ||
+				strncmp( argv[i], "--jobs=", 7 ) == 0 )
+			continue;
+
+		common.push_back( argv[i] );
+	}
+
+	std::vector<BatchEntry> entries;
+	for ( size_t j = 0; j < inputArgs.size(); j++ ) {
+		BatchEntry be;
+		be.label = argv[inputArgs[j]];
+		be.args.push_back( argv[0] );
+		be.args.insert( be.args.end(), common.begin(), common.end() );
+		be.args.push_back( argv[inputArgs[j]] );
+		entries.push_back( be );
+	}
+
+	if ( batchFile != 0 ) {
+		InputMap manifest;
+		if ( !manifest.open( batchFile ) )
+			error() << "could not open batch file " << batchFile << endp;
+
+		const char *p = manifest.data, *pe = manifest.data + manifest.length;
+		while ( p < pe ) {
+			const char *nl = (const char*)memchr( p, '\n', pe - p );
+			const char *eol = nl != 0 ? nl : pe;
+
+			std::vector<string> words;
+			splitWords( p, eol, words );
+			p = eol + 1;
+
+			if ( words.size() == 0 || words[0][0] == '#' )
+				continue;
+
+			/* The input file goes last so the entry's options follow the
+			 * common ones. */
+			BatchEntry be;
+			be.label = words[0];
+			be.args.push_back( argv[0] );
+			be.args.insert( be.args.end(), common.begin(), common.end() );
+			be.args.insert( be.args.end(), words.begin() + 1, words.end() );
+			be.args.push_back( words[0] );
+			entries.push_back( be );
+		}
+	}
+
+	if ( entries.size() == 0 )
+		error() << "batch has no input files" << endp;
+
+	if ( noFork ) {
+		int code = 0;
+		for ( size_t i = 0; i < entries.size(); i++ ) {
+			if ( runBatchEntry( entry, entries[i].args ) != 0 )
+				code = 1;
+		}
+		return code;
+	}
+
+	return runBatchJobs( this, entry, entries, jobs );
+}
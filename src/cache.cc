@@ -0,0 +1,534 @@
+/*
+ * Copyright 2018 Adrian Thurston <thurston@colm.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Compilation cache. Each section with instances gets a key made from the
+ * text of its blocks and of the blocks its includes pull in, the files colm
+ * read, the host language and
+ * the options that affect code generation. The entry holds what each of the
+ * section's write statements put into the output file, along with the state
+ * of the output filter before and after. On a hit the section is not
+ * compiled and the writes are spliced into the output. A write may land on a
+ * different output line than it was recorded on; line directives that point
+ * into the output are moved to match. If the output filter is otherwise not
+ * in the recorded state when a write comes up, the section is compiled after
+ * all and written normally. Sections compiled by --jobs children come back to
+ * the parent as entries of the same form.
+ */
+
+#include <libfsm/ragel.h>
+#include "inputdata.h"
+#include "parsedata.h"
+#include "version.h"
+#include "nragel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+using std::ifstream;
+using std::ofstream;
+using std::ostringstream;
+using std::string;
+using std::endl;
+using std::ios;
+
+static const char cacheMagic[] = "ragel-cache 1";
+
+static string joinArgs( const std::vector<string> &args )
+{
+	string joined;
+	for ( size_t i = 0; i < args.size(); i++ ) {
+		if ( i > 0 )
+			joined += ' ';
+		joined += args[i];
+	}
+	return joined;
+}
+
+/* Offsets of the start of each line. */
+static void lineStarts( const InputMap &input, std::vector<size_t> &lines )
+{
+	lines.clear();
+	lines.push_back( 0 );
+	const char *p = input.data, *pe = input.data + input.length;
+	while ( p < pe ) {
+		p = (const char*) memchr( p, '\n', pe - p );
+		if ( p == 0 )
+			break;
+		p += 1;
+		lines.push_back( p - input.data );
+	}
+}
+
+/* Text of the lines from startLine to endLine, inclusive. */
+static void keyLines( ostringstream &k, const InputMap &input,
+		const std::vector<size_t> &lines, long startLine, long endLine )
+{
+	size_t start = startLine - 1 < (long)lines.size() ?
+			lines[startLine - 1] : input.length;
+	size_t end = endLine < (long)lines.size() ?
+			lines[endLine] : input.length;
+	if ( start < end )
+		k.write( input.data + start, end - start );
+}
+
+static CacheFilterState filterState( output_filter *filter )
+{
+	CacheFilterState state;
+	state.line = filter->line;
+	state.level = filter->level;
+	state.indent = filter->indent;
+	state.singleIndent = filter->singleIndent;
+	return state;
+}
+
+void InputData::makeCacheKey( ParseData *pd, const InputMap &input,
+		const std::vector<size_t> &lines, string &key )
+{
+	ostringstream k;
+
+	k << cacheMagic << '\n' <<
+			"version " VERSION << '\n' <<
+			"host " << progName << '\n' <<
+			"input " << inputFileName << '\n' <<
+			"output " << outputFileName << '\n' <<
+			"section " << pd->sectionName << ' ' << pd->machineId << '\n' <<
+			"options " << codeStyle << ' ' << minimizeLevel << ' ' <<
+			minimizeOpt << ' ' << noLineDirectives << ' ' << forceVar << ' ' <<
+			stringTables << ' ' << wantDupsRemoved << ' ' <<
+			checkPriorInteraction << ' ' << condsCheckDepth << ' ' <<
+			stateLimit << ' ' << maxTransitions << ' ' <<
+			numSplitPartitions << ' ' << transSpanDepth << ' ' <<
+			varBackend << '\n';
+
+	/* The text of the blocks, which has line numbers relative to the start
+	 * of the block. */
+	SectionDictEl *sdEl = sectionDict.find( pd->sectionName );
+	if ( sdEl != 0 ) {
+		Section *section = sdEl->value;
+		for ( Vector<SectionBlock>::Iter b = section->blocks; b.lte(); b++ ) {
+			k << "block " << b->startLine << ' ' << b->endLine << '\n';
+			keyLines( k, input, lines, b->startLine, b->endLine );
+		}
+
+		/* The blocks pulled in by includes. These are not covered by the
+		 * files below when they come from the input file itself. */
+		InputMap other;
+		std::vector<size_t> otherLines;
+		string otherName;
+		for ( std::vector<IncludedBlock>::iterator b = section->included.begin();
+				b != section->included.end(); b++ )
+		{
+			k << "include " << b->fileName << ' ' << b->startLine <<
+					' ' << b->endLine << '\n';
+
+			if ( b->fileName == inputFileName )
+				keyLines( k, input, lines, b->startLine, b->endLine );
+			else {
+				if ( b->fileName != otherName ) {
+					otherName = b->fileName;
+					if ( other.open( otherName.c_str() ) )
+						lineStarts( other, otherLines );
+					else
+						otherLines.clear();
+				}
+				keyLines( k, other, otherLines, b->startLine, b->endLine );
+			}
+		}
+	}
+
+	/* Any other file colm read may have been imported or included. */
+	for ( Vector<const char**>::Iter fns = streamFileNames; fns.lte(); fns++ ) {
+		for ( const char **ptr = *fns; *ptr != 0; ptr++ ) {
+			if ( strcmp( *ptr, inputFileName ) == 0 )
+				continue;
+
+			InputMap data;
+			data.open( *ptr );
+			k << "file " << *ptr << ' ' << data.length << '\n';
+			k.write( data.data, data.length );
+		}
+	}
+
+	key = k.str();
+}
+
+string InputData::cacheFileName( const string &key )
+{
+	/* FNV-1a. The full key is stored in the entry and compared on load, so
+	 * collisions only cost a miss. */
+	unsigned long long hash = 14695981039346656037ULL;
+	for ( size_t i = 0; i < key.size(); i++ ) {
+		hash ^= (unsigned char)key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	char name[32];
+	sprintf( name, "%016llx.rlc", hash );
+	return string( cacheDir ) + "/" + name;
+}
+
+bool InputData::readCacheEntry( const string &fileName, SectionCache *cache )
+{
+	ifstream in( fileName.c_str(), ios::in | ios::binary );
+	if ( !in.is_open() )
+		return false;
+
+	string magic;
+	std::getline( in, magic );
+	if ( magic != cacheMagic )
+		return false;
+
+	long keyLen = 0;
+	in >> keyLen;
+	in.get();
+	if ( !in || keyLen != (long)cache->key.size() )
+		return false;
+
+	string key( keyLen, 0 );
+	in.read( &key[0], keyLen );
+	if ( !in || key != cache->key )
+		return false;
+
+	long numWrites = 0;
+	in >> numWrites;
+	in.get();
+
+	CachedWriteVect writes;
+	for ( long i = 0; in && i < numWrites; i++ ) {
+		CachedWrite w;
+		long argsLen = 0, dataLen = 0;
+		in >> argsLen >> dataLen >>
+				w.before.line >> w.before.level >>
+				w.before.indent >> w.before.singleIndent >>
+				w.after.line >> w.after.level >>
+				w.after.indent >> w.after.singleIndent;
+		in.get();
+
+		if ( !in || argsLen < 0 || dataLen < 0 )
+			return false;
+
+		w.args.resize( argsLen );
+		if ( argsLen > 0 )
+			in.read( &w.args[0], argsLen );
+
+		w.data.resize( dataLen );
+		if ( dataLen > 0 )
+			in.read( &w.data[0], dataLen );
+
+		writes.push_back( w );
+	}
+
+	if ( !in )
+		return false;
+
+	cache->writes.swap( writes );
+	return true;
+}
+
+void InputData::writeCacheEntry( const string &fileName, SectionCache *cache )
+{
+	/* Write to a temporary and rename, so concurrent builds sharing the
+	 * directory never see a partial entry. */
+	ostringstream tmpName;
+	tmpName << fileName << ".tmp." << getpid();
+
+	ofstream out( tmpName.str().c_str(), ios::out | ios::trunc | ios::binary );
+	if ( !out.is_open() )
+		return;
+
+	out << cacheMagic << '\n' << cache->key.size() << '\n' << cache->key <<
+			cache->writes.size() << '\n';
+
+	for ( CachedWriteVect::iterator w = cache->writes.begin();
+			w != cache->writes.end(); w++ )
+	{
+		out << w->args.size() << ' ' << w->data.size() << ' ' <<
+				w->before.line << ' ' << w->before.level << ' ' <<
+				w->before.indent << ' ' << w->before.singleIndent << ' ' <<
+				w->after.line << ' ' << w->after.level << ' ' <<
+				w->after.indent << ' ' << w->after.singleIndent << '\n' <<
+				w->args << w->data;
+	}
+
+	out.close();
+
+	if ( !out || rename( tmpName.str().c_str(), fileName.c_str() ) != 0 )
+		unlink( tmpName.str().c_str() );
+}
+
+/* Compute the keys for all sections and load the entries that exist. */
+void InputData::loadCache()
+{
+	/* Cached output is spliced into the output file. Breadth checks report
+	 * during compilation, so there is nothing to reuse. */
+	if ( outFilter == 0 || checkBreadth )
+		return;
+
+	InputMap input;
+	if ( !input.open( inputFileName ) )
+		return;
+
+	std::vector<size_t> lines;
+	lineStarts( input, lines );
+
+	for ( ParseDataList::Iter pd = parseDataList; pd.lte(); pd++ ) {
+		if ( pd->instanceList.length() == 0 )
+			continue;
+
+		pd->cache = new SectionCache;
+		makeCacheKey( pd, input, lines, pd->cache->key );
+
+		if ( readCacheEntry( cacheFileName( pd->cache->key ), pd->cache ) ) {
+			pd->cache->hit = true;
+			pd->cache->store = false;
+			cacheHits += 1;
+		}
+		else {
+			cacheMisses += 1;
+		}
+	}
+
+	if ( printStatistics ) {
+		stats() << "cache-hits\t" << cacheHits << endl;
+		stats() << "cache-misses\t" << cacheMisses << endl;
+	}
+}
+
+/* Fill in the data of recorded writes from the output file they went to. */
+bool InputData::sliceWrites( const InputMap &output, CachedWriteVect &writes )
+{
+	for ( CachedWriteVect::iterator w = writes.begin(); w != writes.end(); w++ ) {
+		if ( w->start < 0 || w->end < w->start || w->end > (long)output.length )
+			return false;
+		w->data.assign( output.data + w->start, w->end - w->start );
+	}
+	return true;
+}
+
+/* Slice the recorded writes out of the finished output file and store the
+ * entries of the sections that were compiled. */
+void InputData::storeCache()
+{
+	/* Under --pipeline the output went into a pipe and there is no file to
+	 * slice the writes out of. */
+	if ( !outputPath.empty() )
+		return;
+
+	InputMap output;
+	bool haveOutput = false;
+
+	for ( ParseDataList::Iter pd = parseDataList; pd.lte(); pd++ ) {
+		SectionCache *cache = pd->cache;
+		if ( cache == 0 || !cache->store )
+			continue;
+
+		if ( !haveOutput ) {
+			if ( !output.open( outputFileName ) )
+				return;
+			haveOutput = true;
+		}
+
+		if ( sliceWrites( output, cache->writes ) )
+			writeCacheEntry( cacheFileName( cache->key ), cache );
+	}
+}
+
+/* Line directives that return to the output file give a line of the output
+ * itself, so they depend on where the write lands. Move those by delta lines.
+ * Directives into the input file are left alone. Both the plain and the
+ * commented forms that genLineDirectiveC and genLineDirectiveAsm write are
+ * recognized. */
+static void relocateLineDirectives( string &data, const char *fileName, long delta )
+{
+	string target = " \"";
+	for ( const char *pc = fileName; *pc != 0; pc++ ) {
+		if ( *pc == '\\' || *pc == '"' )
+			target += '\\';
+		target += *pc;
+	}
+	target += '"';
+
+	string result;
+	result.reserve( data.size() );
+
+	size_t pos = 0;
+	while ( pos < data.size() ) {
+		size_t nl = data.find( '\n', pos );
+		size_t end = nl == string::npos ? data.size() : nl + 1;
+
+		size_t d = pos;
+		while ( d < end && ( data[d] == '\t' || data[d] == ' ' ) )
+			d += 1;
+		if ( data.compare( d, 3, "/* " ) == 0 )
+			d += 3;
+
+		if ( data.compare( d, 6, "#line " ) == 0 ) {
+			size_t num = d + 6, numEnd = num;
+			while ( numEnd < end && isdigit( (unsigned char)data[numEnd] ) )
+				numEnd += 1;
+
+			if ( numEnd > num && data.compare( numEnd, target.size(), target ) == 0 ) {
+				char buf[32];
+				sprintf( buf, "%ld", strtol( data.c_str() + num, 0, 10 ) + delta );
+				result.append( data, pos, num - pos );
+				result += buf;
+				pos = numEnd;
+			}
+		}
+
+		result.append( data, pos, end - pos );
+		pos = end;
+	}
+
+	data.swap( result );
+}
+
+/* Output line directives are computed from the filter's line count. When
+ * the host never emits them a cached write can go on any line as is. */
+bool InputData::cacheLineIndependent()
+{
+	return hostLang->genLineDirective == &genLineDirectiveTrans;
+}
+
+bool InputData::replayCachedWrite( InputItem *ii )
+{
+	SectionCache *cache = ii->pd->cache;
+	if ( cache->nextWrite >= (long)cache->writes.size() )
+		return false;
+
+	CachedWrite &w = cache->writes[cache->nextWrite];
+	if ( w.args != joinArgs( ii->writeArgs ) )
+		return false;
+
+	CacheFilterState cur = filterState( outFilter );
+	if ( cur.level != w.before.level || cur.indent != w.before.indent ||
+			cur.singleIndent != w.before.singleIndent )
+		return false;
+
+	if ( cur.line != w.before.line && !cacheLineIndependent() ) {
+		relocateLineDirectives( w.data, outFilter->fileName,
+				cur.line - w.before.line );
+	}
+
+	/* Output from a job may still need storing in the cache directory. */
+	if ( cache->store )
+		w.start = outFilter->pubseekoff( 0, ios::cur, ios::out );
+
+	outFilter->writeRaw( w.data.data(), w.data.size() );
+
+	if ( cache->store )
+		w.end = outFilter->pubseekoff( 0, ios::cur, ios::out );
+
+	outFilter->line = cur.line + ( w.after.line - w.before.line );
+	outFilter->level = w.after.level;
+	outFilter->indent = w.after.indent;
+	outFilter->singleIndent = w.after.singleIndent;
+
+	cache->nextWrite += 1;
+	return true;
+}
+
+/* The cached output cannot be used at this write. Compile the section and
+ * bring the code generator up to date by running the writes already spliced
+ * in with the output discarded. */
+bool InputData::cacheFallback( InputItem *ii )
+{
+	ParseData *pd = ii->pd;
+	SectionCache *cache = pd->cache;
+
+	cache->hit = false;
+	if ( cache->job ) {
+		/* The writes already spliced in stay recorded. The rest are
+		 * recorded as they are written. */
+		cache->writes.resize( cache->nextWrite );
+		jobFallbacks += 1;
+	}
+	else {
+		cache->store = false;
+		cacheHits -= 1;
+		cacheMisses += 1;
+	}
+
+	if ( !compileSection( pd ) )
+		return false;
+
+	if ( cache->nextWrite > 0 ) {
+		std::stringbuf discard;
+		outStream->rdbuf( &discard );
+
+		long replayed = 0;
+		for ( InputItem *item = inputItems.head; replayed < cache->nextWrite;
+				item = item->next )
+		{
+			if ( item->type == InputItem::Write && item->pd == pd ) {
+				writeStatement( pd->cgd, item->loc, item->writeArgs.size(),
+						item->writeArgs, generateDot, hostLang );
+				replayed += 1;
+			}
+		}
+
+		outStream->rdbuf( outFilter );
+	}
+
+	return true;
+}
+
+void InputData::writeCached( InputItem *ii )
+{
+	SectionCache *cache = ii->pd->cache;
+
+	if ( cache->hit ) {
+		if ( replayCachedWrite( ii ) )
+			return;
+
+		if ( !cacheFallback( ii ) )
+			return;
+	}
+
+	recordWrite( ii, cache );
+}
+
+/* Write normally, noting where the output went and the filter state on
+ * either side. */
+void InputData::recordWrite( InputItem *ii, SectionCache *cache )
+{
+	CachedWrite w;
+	w.args = joinArgs( ii->writeArgs );
+	w.before = filterState( outFilter );
+	w.start = outFilter->pubseekoff( 0, ios::cur, ios::out );
+
+	writeStatement( ii->pd->cgd, ii->loc, ii->writeArgs.size(),
+			ii->writeArgs, generateDot, hostLang );
+
+	w.after = filterState( outFilter );
+	w.end = outFilter->pubseekoff( 0, ios::cur, ios::out );
+
+	if ( cache->store )
+		cache->writes.push_back( w );
+}
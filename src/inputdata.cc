@@ -49,6 +49,20 @@
 #if defined(HAVE_SYS_WAIT_H)
 #include <sys/wait.h>
 #endif
+#if defined(HAVE_SYS_RESOURCE_H)
+#include <sys/resource.h>
+#endif
+#if defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#endif
+#if defined(HAVE_DIRENT_H)
+#include <dirent.h>
+#endif
+#if !defined(_WIN32)
+#include <sys/time.h>
+#endif
+#include <algorithm>
+#include <new>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -92,6 +106,15 @@ InputData::~InputData()
 	if ( histogramFn != 0 )
 		::free( (void*)histogramFn );
 
+	if ( trainHistogramPath != 0 )
+		::free( (void*)trainHistogramPath );
+
+	if ( cacheDir != 0 )
+		::free( (void*)cacheDir );
+
+	if ( batchFile != 0 )
+		::free( (void*)batchFile );
+
 	if ( histogram != 0 )
 		delete[] histogram;
 
@@ -99,6 +122,204 @@ InputData::~InputData()
 		free( (void*) *bl );
 }
 
+/* Milliseconds on a clock that is only meaningful for differences. */
+double InputData::phaseClock()
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter( &count );
+	QueryPerformanceFrequency( &freq );
+	return (double)count.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+	struct timeval tv;
+	gettimeofday( &tv, 0 );
+	return (double)tv.tv_sec * 1000.0 + (double)tv.tv_usec / 1000.0;
+#endif
+}
+
+long InputData::peakRssKb()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+	if ( GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof(pmc) ) )
+		return pmc.PeakWorkingSetSize / 1024;
+	return -1;
+#elif defined(HAVE_SYS_RESOURCE_H)
+	struct rusage usage;
+	if ( getrusage( RUSAGE_SELF, &usage ) != 0 )
+		return -1;
+#if defined(__APPLE__)
+	/* Reported in bytes. */
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+#else
+	return -1;
+#endif
+}
+
+#if defined(__linux__)
+static int statmFd = -1;
+static pid_t statmPid = 0;
+#endif
+
+/* Resident size now, rather than the peak. Where it cannot be read the peak
+ * is used, which never goes back down. */
+long InputData::currentRssKb()
+{
+#if defined(__linux__)
+	/* Kept open and read with a single call. A forked child opens its own,
+	 * since the one it inherits describes the parent. */
+	if ( statmFd < 0 || statmPid != getpid() ) {
+		if ( statmFd >= 0 )
+			close( statmFd );
+		statmFd = open( "/proc/self/statm", O_RDONLY );
+		statmPid = getpid();
+	}
+
+	/* Sizes in pages: total, then resident. */
+	char buf[128];
+	ssize_t len = statmFd >= 0 ? pread( statmFd, buf, sizeof(buf) - 1, 0 ) : -1;
+	if ( len > 0 ) {
+		buf[len] = 0;
+		long size = 0, resident = -1;
+		if ( sscanf( buf, "%ld %ld", &size, &resident ) == 2 )
+			return resident * ( sysconf( _SC_PAGESIZE ) / 1024 );
+	}
+#endif
+	return peakRssKb();
+}
+
+void InputData::recordPhase( PhaseTimeVect &times, const char *phase,
+		const std::string &section, const std::string &name,
+		double start, FsmAp *fsm )
+{
+	long states = -1, trans = -1;
+	if ( fsm != 0 ) {
+		states = fsm->stateList.length();
+		trans = 0;
+		for ( StateAp *st = fsm->stateList.head; st != 0; st = st->next )
+			trans += st->outList.length();
+	}
+
+	times.push_back( PhaseTime( phase, section, name, start,
+			phaseClock() - start, peakRssKb(), states, trans ) );
+}
+
+static void writeJsonString( ostream &out, const std::string &s )
+{
+	out << '"';
+	for ( std::string::const_iterator c = s.begin(); c != s.end(); c++ ) {
+		if ( *c == '"' || *c == '\\' )
+			out << '\\' << *c;
+		else if ( (unsigned char)*c < 0x20 ) {
+			out << "\\u00" << std::hex << std::setw(2) << std::setfill('0') <<
+					(int)(unsigned char)*c << std::dec << std::setfill(' ');
+		}
+		else
+			out << *c;
+	}
+	out << '"';
+}
+
+static bool phaseTimeBefore( const PhaseTime &p1, const PhaseTime &p2 )
+{
+	return p1.start < p2.start;
+}
+
+static long long limitBytes = 0;
+
+#if defined(HAVE_SYS_RESOURCE_H) && defined(RLIMIT_DATA)
+static struct rlimit prevDataLimit;
+static bool dataLimitSet = false;
+#endif
+
+/* An allocation failed under the allocation limit. The graph code does not
+ * expect allocations to fail, so nothing is unwound through it. Report and
+ * exit. */
+static void memoryLimitExceeded()
+{
+	std::set_new_handler( 0 );
+	std::cerr << "ragel: memory limit of " << limitBytes <<
+			" bytes exceeded, allocation failed" << std::endl;
+	exit( 1 );
+}
+
+/* Make an allocation that would put us well past the memory limit stop the
+ * process, rather than leaving it to the system to kill us. The limit
+ * checked between operators is the one that is normally hit. Set only while
+ * the frontend compiles, and inherited by --jobs children. */
+void InputData::limitMemory()
+{
+	limitBytes = memoryLimit;
+	std::set_new_handler( memoryLimitExceeded );
+
+#if defined(HAVE_SYS_RESOURCE_H) && defined(RLIMIT_DATA)
+	long long backstop = memoryLimit + memoryLimit / 2 + 64LL * 1024 * 1024;
+
+	struct rlimit rl;
+	if ( getrlimit( RLIMIT_DATA, &rl ) == 0 ) {
+		if ( rl.rlim_max == RLIM_INFINITY || (long long)rl.rlim_max > backstop ) {
+			prevDataLimit = rl;
+			rl.rlim_cur = backstop;
+			dataLimitSet = setrlimit( RLIMIT_DATA, &rl ) == 0;
+		}
+	}
+#endif
+}
+
+/* Put back what limitMemory changed, so that a batch of in-process entries
+ * or an rlhc run in this process is not held to the frontend's limit. */
+void InputData::unlimitMemory()
+{
+	std::set_new_handler( 0 );
+
+#if defined(HAVE_SYS_RESOURCE_H) && defined(RLIMIT_DATA)
+	if ( dataLimitSet ) {
+		setrlimit( RLIMIT_DATA, &prevDataLimit );
+		dataLimitSet = false;
+	}
+#endif
+}
+
+/* Write out, and then forget, the timings recorded so far in this process.
+ * One JSON object per line, in the order the phases started. */
+void InputData::writeTimeReport()
+{
+	if ( !timeReport )
+		return;
+
+	PhaseTimeVect all = phaseTimes;
+	phaseTimes.clear();
+	for ( ParseDataList::Iter pd = parseDataList; pd.lte(); pd++ ) {
+		all.insert( all.end(), pd->phaseTimes.begin(), pd->phaseTimes.end() );
+		pd->phaseTimes.clear();
+	}
+
+	std::stable_sort( all.begin(), all.end(), phaseTimeBefore );
+
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(3);
+	for ( PhaseTimeVect::iterator pt = all.begin(); pt != all.end(); pt++ ) {
+		out << "{\"phase\":";
+		writeJsonString( out, pt->phase );
+		out << ",\"section\":";
+		writeJsonString( out, pt->section );
+		out << ",\"name\":";
+		writeJsonString( out, pt->name );
+		out << ",\"wall_ms\":" << pt->wallMs <<
+				",\"peak_rss_kb\":" << pt->peakRssKb;
+		if ( pt->states >= 0 ) {
+			out << ",\"states\":" << pt->states <<
+					",\"transitions\":" << pt->trans;
+		}
+		out << "}\n";
+	}
+
+	std::cerr << out.str() << std::flush;
+}
+
 void InputData::makeDefaultFileName()
 {
 	if ( outputFileName == 0 )
@@ -138,7 +359,8 @@ void InputData::createOutputStream()
 void InputData::openOutput()
 {
 	if ( outFilter != 0 ) {
-		outFilter->open( outputFileName, ios::out|ios::trunc );
+		const char *path = outputPath.empty() ? outputFileName : outputPath.c_str();
+		outFilter->open( path, ios::out|ios::trunc );
 		if ( !outFilter->is_open() ) {
 			error() << "error opening " << outputFileName << " for writing" << endl;
 			abortCompile( 1 );
@@ -209,7 +431,8 @@ void InputData::generateReduced()
 void InputData::verifyWriteHasData( InputItem *ii )
 {
 	if ( ii->type == InputItem::Write ) {
-		if ( ii->pd->cgd == 0 )
+		bool cached = ii->pd->cache != 0 && ii->pd->cache->hit;
+		if ( ii->pd->cgd == 0 && !cached )
 			error( ii->loc ) << ii->pd->sectionName << ": no machine instantiations to write" << endl;
 	}
 }
@@ -307,15 +530,30 @@ void InputData::writeStatement( CodeGenData *cgd, InputLoc &loc, int nargs,
 
 void InputData::writeOutput( InputItem *ii )
 {
+	double start = printStatistics || timeReport ? phaseClock() : 0;
+
 	/* If it is the first input item then check if we need to write the BOM. */
 	if ( ii->prev == 0 && utf8BomPresent )
 		*outStream << (uchar)0xEF << (uchar)0xBB << (uchar) 0xBF;
 
 	switch ( ii->type ) {
 		case InputItem::Write: {
+			if ( ii->pd->cache != 0 ) {
+				writeCached( ii );
+				break;
+			}
+
 			CodeGenData *cgd = ii->pd->cgd;
 			writeStatement( cgd, ii->loc, ii->writeArgs.size(),
 					ii->writeArgs, generateDot, hostLang );
+
+			if ( timeReport ) {
+				std::string name;
+				for ( size_t a = 0; a < ii->writeArgs.size(); a++ )
+					name += ( a > 0 ? " " : "" ) + ii->writeArgs[a];
+				recordPhase( phaseTimes, "write", ii->pd->sectionName,
+						name, start, 0 );
+			}
 			break;
 		}
 		case InputItem::HostData: {
@@ -341,6 +579,9 @@ void InputData::writeOutput( InputItem *ii )
 			break;
 		}
 	}
+
+	if ( printStatistics )
+		emitMs += phaseClock() - start;
 }
 
 void InputData::closeOutput()
@@ -382,6 +623,274 @@ void InputData::processDot()
 	closeOutput();
 }
 
+/* Build, minimize and reduce a single section. */
+bool InputData::compileSection( ParseData *pd )
+{
+	FsmRes res = pd->prepareMachineGen( 0, hostLang );
+
+	/* Compute exports from the export definitions. */
+	pd->makeExports();
+
+	if ( !res.success() )
+		return false;
+
+	if ( errorCount > 0 )
+		return false;
+
+	pd->generateReduced( inputFileName, codeStyle, *outStream, hostLang );
+
+	if ( errorCount > 0 )
+		return false;
+
+	return true;
+}
+
+#if defined(HAVE_SYS_WAIT_H)
+
+/* A section being compiled in a child process. The child leaves the
+ * section's writes in the entry file and its diagnostics in the log file. */
+struct CompileJob
+{
+	ParseData *pd;
+	pid_t pid;
+	int status;
+	std::string entryName;
+	std::string logName;
+};
+
+static bool makeTempFile( std::string &name )
+{
+	const char *dir = getenv( "TMPDIR" );
+	std::string path = std::string( dir != 0 && *dir != 0 ? dir : "/tmp" ) +
+			"/ragel-XXXXXX";
+
+	std::vector<char> buf( path.begin(), path.end() );
+	buf.push_back( 0 );
+
+	int fd = mkstemp( &buf[0] );
+	if ( fd < 0 )
+		return false;
+
+	close( fd );
+	name = &buf[0];
+	return true;
+}
+
+#endif
+
+static std::string jobKey( ParseData *pd )
+{
+	return "job " + pd->sectionName;
+}
+
+/* Runs in a --jobs child. Compiles the section, then writes the host data and
+ * this section's writes to a scratch file, recording each write the way the
+ * cache does. The other sections' writes are left out, so the line recorded
+ * for each write is the one the host data alone leads to. The parent moves
+ * the line directives that point into the output when it splices a write in
+ * on a later line. */
+int InputData::compileJob( ParseData *pd, const std::string &entryName )
+{
+	if ( !compileSection( pd ) )
+		return 1;
+
+	SectionCache cache;
+	cache.key = pd->cache != 0 ? pd->cache->key : jobKey( pd );
+
+	/* The filter carries the real output file name, which line directives
+	 * back into the output refer to. */
+	std::string scratchName = entryName + ".out";
+	output_filter *filter = new output_filter( outputFileName );
+	filter->open( scratchName.c_str(), ios::out|ios::trunc );
+	if ( !filter->is_open() ) {
+		delete filter;
+		return 1;
+	}
+
+	outFilter = filter;
+	outStream = new ostream( filter );
+
+	for ( InputItem *ii = inputItems.head; ii != 0; ii = ii->next ) {
+		if ( ii->type == InputItem::HostData )
+			writeOutput( ii );
+		else if ( ii->type == InputItem::Write && ii->pd == pd )
+			recordWrite( ii, &cache );
+	}
+
+	delete outStream;
+	delete filter;
+
+	InputMap output;
+	bool sliced = output.open( scratchName.c_str() ) &&
+			sliceWrites( output, cache.writes );
+	output.close();
+	unlink( scratchName.c_str() );
+
+	if ( !sliced || errorCount > 0 )
+		return 1;
+
+	writeCacheEntry( entryName, &cache );
+	return 0;
+}
+
+/* Compile the sections with instances up front, each in a child process, up
+ * to --jobs at a time. The children share nothing with each other or with
+ * us. Each hands back what its section's writes produced, and flushRemaining
+ * splices that in as it would a cache hit. A write whose filter state was not
+ * predicted falls back to compiling the section here. Diagnostics are passed
+ * on in section order once all children are done. */
+void InputData::compileAllSections()
+{
+#if defined(HAVE_SYS_WAIT_H)
+	/* Compiling ahead keeps every section's output around at once, which is
+	 * just what low memory mode is avoiding. The results are spliced into the
+	 * output file, so there must be one. Breadth checks report during
+	 * compilation. */
+	if ( jobs <= 1 || lowMemory || noFork || outFilter == 0 || checkBreadth )
+		return;
+
+	std::vector<CompileJob> compileJobs;
+	for ( ParseDataList::Iter pd = parseDataList; pd.lte(); pd++ ) {
+		bool cached = pd->cache != 0 && pd->cache->hit;
+		if ( pd->instanceList.length() > 0 && !cached ) {
+			CompileJob job;
+			job.pd = pd;
+			job.pid = -1;
+			job.status = 0;
+			compileJobs.push_back( job );
+		}
+	}
+
+	/* Nothing to gain. Leave it to checkLastRef. */
+	if ( compileJobs.size() <= 1 )
+		return;
+
+	size_t next = 0;
+	long running = 0;
+	while ( next < compileJobs.size() || running > 0 ) {
+		while ( running < jobs && next < compileJobs.size() ) {
+			CompileJob &job = compileJobs[next++];
+			if ( !makeTempFile( job.entryName ) )
+				continue;
+			if ( !makeTempFile( job.logName ) ) {
+				unlink( job.entryName.c_str() );
+				job.entryName.clear();
+				continue;
+			}
+
+			std::cout.flush();
+			std::cerr.flush();
+
+			job.pid = fork();
+			if ( job.pid == 0 ) {
+				int log = open( job.logName.c_str(), O_WRONLY|O_TRUNC );
+				if ( log >= 0 ) {
+					dup2( log, 2 );
+					close( log );
+				}
+
+				/* The timings copied in by the fork are the parent's to
+				 * report. This child reports its section's, through the log
+				 * the parent passes on. */
+				phaseTimes.clear();
+				for ( ParseDataList::Iter other = parseDataList; other.lte(); other++ )
+					other->phaseTimes.clear();
+
+				int code = 1;
+				try {
+					code = compileJob( job.pd, job.entryName );
+				}
+				catch ( const AbortCompile &ac ) {
+					code = ac.code != 0 ? ac.code : 1;
+				}
+
+				writeTimeReport();
+				std::cerr.flush();
+				exit( code );
+			}
+
+			if ( job.pid > 0 )
+				running += 1;
+		}
+
+		if ( running == 0 )
+			continue;
+
+		int status = 0;
+		pid_t pid = waitpid( -1, &status, 0 );
+		if ( pid < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			break;
+		}
+
+		for ( size_t j = 0; j < compileJobs.size(); j++ ) {
+			if ( compileJobs[j].pid == pid ) {
+				compileJobs[j].status = status;
+				running -= 1;
+			}
+		}
+	}
+
+	for ( size_t j = 0; j < compileJobs.size(); j++ ) {
+		CompileJob &job = compileJobs[j];
+		ParseData *pd = job.pd;
+
+		/* Could not be started. Compiled normally by checkLastRef. */
+		if ( job.pid <= 0 ) {
+			if ( !job.entryName.empty() ) {
+				unlink( job.entryName.c_str() );
+				unlink( job.logName.c_str() );
+			}
+			continue;
+		}
+
+		InputMap log;
+		if ( log.open( job.logName.c_str() ) && log.length > 0 ) {
+			std::cerr.write( log.data, log.length );
+			std::cerr.flush();
+		}
+		log.close();
+		unlink( job.logName.c_str() );
+
+		if ( WIFSIGNALED( job.status ) ) {
+			error() << "compiling " << pd->sectionName << " stopped by signal: " <<
+					WTERMSIG( job.status ) << endl;
+			pd->compiled = true;
+			pd->compileSuccess = false;
+		}
+		else if ( WEXITSTATUS( job.status ) != 0 ) {
+			/* The child reported its errors, we only need to know there
+			 * were some. */
+			pd->compiled = true;
+			pd->compileSuccess = false;
+			errorCount += 1;
+		}
+		else {
+			SectionCache *cache = pd->cache;
+			if ( cache == 0 ) {
+				cache = new SectionCache;
+				cache->key = jobKey( pd );
+				cache->store = false;
+			}
+
+			/* If the entry cannot be read the section is compiled normally
+			 * by checkLastRef. */
+			if ( readCacheEntry( job.entryName, cache ) ) {
+				cache->hit = true;
+				cache->job = true;
+				pd->cache = cache;
+			}
+			else if ( cache != pd->cache ) {
+				delete cache;
+			}
+		}
+
+		unlink( job.entryName.c_str() );
+	}
+#endif
+}
+
 bool InputData::checkLastRef( InputItem *ii )
 {
 	if ( generateDot )
@@ -405,20 +914,15 @@ bool InputData::checkLastRef( InputItem *ii )
 				ii->parser->terminateParser();
 #endif
 
-			FsmRes res = pd->prepareMachineGen( 0, hostLang );
+			/* May have already failed in a --jobs child, or not be needed
+			 * at all if the writes are coming from the cache or a child. */
+			bool success = true;
+			if ( pd->compiled )
+				success = pd->compileSuccess;
+			else if ( pd->cache == 0 || !pd->cache->hit )
+				success = compileSection( pd );
 
-			/* Compute exports from the export definitions. */
-			pd->makeExports();
-
-			if ( !res.success() )
-				return false;
-
-			if ( errorCount > 0 )
-				return false;
-
-			pd->generateReduced( inputFileName, codeStyle, *outStream, hostLang );
-
-			if ( errorCount > 0 )
+			if ( !success )
 				return false;
 		}
 
@@ -444,12 +948,33 @@ bool InputData::checkLastRef( InputItem *ii )
 			/* Flush out. */
 			writeOutput( lastFlush );
 
+			if ( lowMemory )
+				releaseFlushed( lastFlush );
+
 			lastFlush = lastFlush->next;
 		}
 	}
 	return true;
 }
 
+/* In low memory mode, drop what a written input item no longer needs. Once
+ * the last reference to a section is out, nothing else uses its graph,
+ * reduced machine, actions or parse tree. */
+void InputData::releaseFlushed( InputItem *ii )
+{
+	if ( ii->type == InputItem::HostData )
+		ii->data.str( std::string() );
+
+	if ( ii->section != 0 && ii->section->lastReference == ii && ii->pd != 0 ) {
+		ii->pd->clear();
+
+		if ( printStatistics ) {
+			stats() << "released\t" << ii->pd->sectionName <<
+					"\t" << peakRssKb() << endl;
+		}
+	}
+}
+
 void InputData::makeFirstInputItem()
 {
 	/* Make the first input item. */
@@ -590,8 +1115,13 @@ bool InputData::parseReduce()
 	lastFlush = inputItems.head;
 
 
+	double start = timeReport ? phaseClock() : 0;
+
 	topLevel->reduceFile( "rlparse", inputFileName );
 
+	if ( timeReport )
+		recordPhase( phaseTimes, "reduce", "", inputFileName, start, 0 );
+
 	if ( errorCount )
 		return false;
 
@@ -613,32 +1143,65 @@ bool InputData::processReduce()
 		openOutput();
 
 		bool success = parseReduce();
-		if ( success )
+		if ( success ) {
+			if ( cacheDir != 0 )
+				loadCache();
+
+			compileAllSections();
 			flushRemaining();
+		}
+
+		if ( printStatistics ) {
+			if ( jobs > 1 )
+				stats() << "job-fallbacks\t" << jobFallbacks << endl;
+			stats() << "emit-time-ms\t" << emitMs << endl;
+			stats() << "peak-rss-kb\t" << peakRssKb() << endl;
+		}
 
 		closeOutput();
 
 		if ( !success && outputFileName != 0 )
 			unlink( outputFileName );
 
+		if ( success && cacheDir != 0 && errorCount == 0 )
+			storeCache();
+
 		return success;
 	}
 }
 
 bool InputData::process()
 {
-	switch ( frontend ) {
-		case KelbtBased: {
+	if ( memoryLimit > 0 )
+		limitMemory();
+
+	bool success = false;
+	try {
+		switch ( frontend ) {
+			case KelbtBased: {
 #ifdef WITH_RAGEL_KELBT
-			processKelbt();
+				processKelbt();
 #endif
-			return true;
-		}
-		case ReduceBased: {
-			return processReduce();
+				success = true;
+				break;
+			}
+			case ReduceBased: {
+				success = processReduce();
+				break;
+			}
 		}
 	}
-	return false;
+	catch ( const AbortCompile & ) {
+		if ( memoryLimit > 0 )
+			unlimitMemory();
+		throw;
+	}
+
+	if ( memoryLimit > 0 )
+		unlimitMemory();
+
+	writeTimeReport();
+	return success;
 }
 
 /* Print a summary of the options. */
@@ -650,13 +1213,33 @@ void InputData::usage()
 "   -h, -H, -?, --help   Print this usage and exit\n"
 "   -v, --version        Print version information and exit\n"
 "   -o <file>            Write output to <file>\n"
-"   -s                   Print some statistics and compilation info to stderr\n"
+"   -s                   Print some statistics and compilation info to stderr,\n"
+"                        ending with the peak resident size (peak-rss-kb)\n"
+"   --time-report=json   Print the time, peak memory and state counts of each\n"
+"                        compile phase to stderr, one JSON object per line\n"
+"                        (--jobs children report their sections' phases)\n"
+"   --op-report[=N]      Print the N operators (default 10) that produced the\n"
+"                        largest graphs, with their definition and location\n"
 "   -d                   Do not remove duplicates from action lists\n"
 "   -I <dir>             Add <dir> to the list of directories to search\n"
 "                        for included an imported files\n"
 "   --rlhc               Show the rlhc command used to compile\n"
 "   --save-temps         Do not delete intermediate file during compilation\n"
 "   --no-intermediate    Disable call to rlhc, leave behind intermediate\n"
+"   --pipeline           Run the frontend and rlhc as a single job, passing\n"
+"                        the intermediate through a pipe (through the file\n"
+"                        with --no-fork or --save-temps)\n"
+"   --jobs[=N]           Compile independent machine sections in N child\n"
+"                        processes (default: number of processors). With -s,\n"
+"                        job-fallbacks counts sections compiled again here\n"
+"   --low-memory         Free each machine section after its last write\n"
+"                        (compiles sections one at a time, overriding --jobs)\n"
+"   --cache-dir=DIR      Reuse the generated code of unchanged sections,\n"
+"                        keeping it in the existing directory DIR (entries\n"
+"                        are read but not stored under --pipeline)\n"
+"   --batch=FILE         Compile each line of FILE (input file and options)\n"
+"                        as its own job, up to --jobs at a time. Giving more\n"
+"                        than one input file also compiles them as a batch\n"
 "error reporting format:\n"
 "   --error-format=gnu   file:line:column: message (default)\n"
 "   --error-format=msvc  file(line,column): message\n"
@@ -708,10 +1291,19 @@ void InputData::usage()
 "                                of the machine (depth D from start state).\n"
 "   --state-limit=L              Report fail if number of states exceeds this\n"
 "                                during compilation.\n"
+"   --memory-limit=SIZE          Report fail if memory use exceeds SIZE bytes\n"
+"                                (K, M or G suffix) while building machines.\n"
+"                                The limit is on the resident size of the\n"
+"                                compiling process, or the child compiling a\n"
+"                                section under --jobs, checked as graphs grow.\n"
 "   --breadth-check=E1,E2,..     Report breadth cost of named entry points and\n"
 "                                the start state.\n"
 "   --input-histogram=FN         Input char histogram for breadth check. If\n"
 "                                unspecified a flat histogram is used.\n"
+"   --train-histogram=PATH       Derive the histogram from the sample input in\n"
+"                                PATH (a file or a directory of them). With no\n"
+"                                input file, write it out (to -o or stdout) in\n"
+"                                the --input-histogram format.\n"
 "testing:\n"
 "   --kelbt-frontend        Compile using original ragel + kelbt frontend\n"
 "                           Requires ragel be built with ragel + kelbt support\n"
@@ -911,10 +1503,12 @@ void InputData::parseArgs( int argc, const char **argv )
 	if ( lastSlash == 0 ) {
 		/* Defualt to the the binary install location. */
 		dirName = BINDIR;
+		progName = argv[0];
 	}
 	else {
 		/* Compute dirName from argv0. */
 		dirName = string( argv[0], lastSlash - argv[0] );
+		progName = lastSlash + 1;
 	}
 
 	/* FIXME: Need to check code styles VS langauge. */
@@ -1092,10 +1686,78 @@ void InputData::parseArgs( int argc, const char **argv )
 				}
 				else if ( strcmp( arg, "input-histogram" ) == 0 )
 					histogramFn = strdup(eq);
+				else if ( strcmp( arg, "train-histogram" ) == 0 ) {
+					if ( eq == 0 || *eq == 0 )
+						error() << "expecting '=path' for train-histogram" << endl;
+					else
+						trainHistogramPath = strdup( eq );
+				}
 				else if ( strcmp( arg, "var-backend" ) == 0 )
 					forceVar = true;
 				else if ( strcmp( arg, "no-fork" ) == 0 )
 					noFork = true;
+				else if ( strcmp( arg, "pipeline" ) == 0 )
+					pipeline = true;
+				else if ( strcmp( arg, "time-report" ) == 0 ) {
+					if ( eq == 0 || strcmp( eq, "json" ) != 0 )
+						error() << "expecting '=json' for time-report" << endl;
+					else
+						timeReport = true;
+				}
+				else if ( strcmp( arg, "memory-limit" ) == 0 ) {
+					char *end = 0;
+					memoryLimit = eq != 0 ? strtoll( eq, &end, 10 ) : 0;
+					if ( end != 0 ) {
+						switch ( *end ) {
+							case 'k': case 'K': memoryLimit *= 1024LL; end++; break;
+							case 'm': case 'M': memoryLimit *= 1024LL * 1024; end++; break;
+							case 'g': case 'G': memoryLimit *= 1024LL * 1024 * 1024; end++; break;
+						}
+					}
+
+					if ( memoryLimit <= 0 || end == 0 || *end != 0 )
+						error() << "expecting '=size' for memory-limit, with "
+								"an optional K, M or G suffix" << endl;
+				}
+				else if ( strcmp( arg, "low-memory" ) == 0 )
+					lowMemory = true;
+				else if ( strcmp( arg, "batch" ) == 0 ) {
+					if ( eq == 0 || *eq == 0 )
+						error() << "expecting '=file' for batch" << endl;
+					else
+						batchFile = strdup( eq );
+				}
+				else if ( strcmp( arg, "op-report" ) == 0 ) {
+					if ( eq == 0 )
+						opReport = 10;
+					else
+						opReport = strtol( eq, 0, 10 );
+
+					if ( opReport < 1 )
+						error() << "invalid value for op-report" << endl;
+				}
+				else if ( strcmp( arg, "cache-dir" ) == 0 ) {
+					if ( eq == 0 || *eq == 0 )
+						error() << "expecting '=dir' for cache-dir" << endl;
+					else
+						cacheDir = strdup( eq );
+				}
+#if defined(HAVE_SYS_WAIT_H)
+				else if ( strcmp( arg, "jobs" ) == 0 ) {
+					if ( eq == 0 )
+						jobs = sysconf( _SC_NPROCESSORS_ONLN );
+					else
+						jobs = strtol( eq, 0, 10 );
+
+					if ( jobs < 1 )
+						error() << "invalid value for jobs" << endl;
+				}
+#else
+				else if ( strcmp( arg, "jobs" ) == 0 ) {
+					error() << "--jobs specified but, "
+							"ragel not built with fork support" << endp;
+				}
+#endif
 				else {
 					error() << "--" << pc.paramArg << 
 							" is an invalid argument" << endl;
@@ -1173,11 +1835,12 @@ void InputData::parseArgs( int argc, const char **argv )
 			/* It is interpreted as an input file. */
 			if ( *pc.curArg == 0 )
 				error() << "a zero length input file name was given" << endl;
-			else if ( inputFileName != 0 )
-				error() << "more than one input file name was given" << endl;
 			else {
-				/* OK, Remember the filename. */
-				inputFileName = pc.curArg;
+				/* OK, Remember the filename. Any further input files make
+				 * this a batch, checked once all the args are in. */
+				if ( inputFileName == 0 )
+					inputFileName = pc.curArg;
+				inputArgs.push_back( pc.iCurArg - 1 );
 			}
 			break;
 		}
@@ -1222,6 +1885,109 @@ void InputData::loadHistogram()
 	}
 }
 
+/* Count the bytes of a sample file, or of every file below a directory. */
+void InputData::trainHistogramFrom( const string &path, double *counts, long &files )
+{
+	struct stat st;
+	if ( stat( path.c_str(), &st ) != 0 )
+		error() << "histogram train: could not stat " << path << endp;
+
+#if defined(HAVE_DIRENT_H)
+	if ( S_ISDIR( st.st_mode ) ) {
+		DIR *dir = opendir( path.c_str() );
+		if ( dir == 0 )
+			error() << "histogram train: could not open directory " << path << endp;
+
+		std::vector<string> names;
+		struct dirent *de;
+		while ( ( de = readdir( dir ) ) != 0 ) {
+			if ( de->d_name[0] != '.' )
+				names.push_back( de->d_name );
+		}
+		closedir( dir );
+
+		/* Same result whatever order the directory lists in. */
+		std::sort( names.begin(), names.end() );
+		for ( std::vector<string>::iterator n = names.begin(); n != names.end(); n++ )
+			trainHistogramFrom( path + "/" + *n, counts, files );
+		return;
+	}
+#endif
+
+	if ( !S_ISREG( st.st_mode ) )
+		return;
+
+	InputMap sample;
+	if ( !sample.open( path.c_str() ) )
+		error() << "histogram train: could not read " << path << endp;
+
+	const unsigned char *p = (const unsigned char*)sample.data;
+	const unsigned char *pe = p + sample.length;
+	long local[256];
+	memset( local, 0, sizeof(local) );
+	while ( p < pe )
+		local[*p++] += 1;
+
+	for ( int i = 0; i < 256; i++ )
+		counts[i] += local[i];
+
+	files += 1;
+}
+
+void InputData::trainHistogram()
+{
+	const int alphsize = 256;
+
+	double *counts = new double[alphsize];
+	for ( int i = 0; i < alphsize; i++ )
+		counts[i] = 0;
+
+	long files = 0;
+	trainHistogramFrom( trainHistogramPath, counts, files );
+
+	double total = 0;
+	for ( int i = 0; i < alphsize; i++ )
+		total += counts[i];
+
+	if ( total == 0 ) {
+		delete[] counts;
+		error() << "histogram train: no sample input found in " <<
+				trainHistogramPath << endp;
+	}
+
+	for ( int i = 0; i < alphsize; i++ )
+		counts[i] /= total;
+
+	if ( printStatistics ) {
+		stats() << "histogram-files\t" << files << endl;
+		stats() << "histogram-bytes\t" << (long long)total << endl;
+	}
+
+	histogram = counts;
+}
+
+/* Train only. Writes the histogram where --input-histogram can read it. */
+int InputData::writeTrainedHistogram()
+{
+	trainHistogram();
+
+	ofstream file;
+	ostream *out = &std::cout;
+	if ( outputFileName != 0 ) {
+		file.open( outputFileName );
+		if ( !file.is_open() )
+			error() << "histogram train: could not open " << outputFileName << endp;
+		out = &file;
+	}
+
+	*out << std::setprecision(17);
+	for ( int i = 0; i < 256; i++ )
+		*out << histogram[i] << '\n';
+	out->flush();
+
+	return 0;
+}
+
 void InputData::defaultHistogram()
 {
 	/* Flat histogram. */
@@ -1254,14 +2020,76 @@ void InputData::checkArgs()
 	if ( !frontendSpecified )
 		frontend = ReduceBased;
 
+	if ( histogramFn != 0 && trainHistogramPath != 0 )
+		error() << "--input-histogram and --train-histogram are mutually exclusive" << endp;
+
 	if ( checkBreadth ) {
-		if ( histogramFn != 0 )
+		if ( trainHistogramPath != 0 )
+			trainHistogram();
+		else if ( histogramFn != 0 )
 			loadHistogram();
 		else
 			defaultHistogram();
 	}
 }
 
+bool InputMap::open( const char *fileName )
+{
+	close();
+
+	struct stat st;
+	if ( stat( fileName, &st ) != 0 )
+		return false;
+
+	length = st.st_size;
+
+#if defined(HAVE_SYS_MMAN_H)
+	if ( length > 0 ) {
+		int fd = ::open( fileName, O_RDONLY );
+		if ( fd >= 0 ) {
+			void *addr = mmap( 0, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+			::close( fd );
+			if ( addr != MAP_FAILED ) {
+				data = (const char*)addr;
+				mapped = true;
+				return true;
+			}
+		}
+	}
+#endif
+
+	FILE *file = fopen( fileName, "rb" );
+	if ( file == 0 )
+		return false;
+
+	buf = new char[length > 0 ? length : 1];
+	size_t got = length > 0 ? fread( buf, 1, length, file ) : 0;
+	fclose( file );
+
+	if ( got != length ) {
+		close();
+		return false;
+	}
+
+	data = buf;
+	return true;
+}
+
+void InputMap::close()
+{
+#if defined(HAVE_SYS_MMAN_H)
+	if ( mapped )
+		munmap( (void*)data, length );
+#endif
+	if ( buf != 0 )
+		delete[] buf;
+
+	data = 0;
+	length = 0;
+	mapped = false;
+	buf = 0;
+}
+
 char *InputData::readInput( const char *inputFileName )
 {
 	struct stat st;
@@ -1301,13 +2129,102 @@ int InputData::runRlhc( int argc, const char **argv )
 	struct colm_program *prg;
 	int exit_status;
 
+	double start = timeReport ? phaseClock() : 0;
+
 	prg = colm_new_program( rlhcSections );
 	colm_set_debug( prg, 0 );
 	colm_run_program( prg, argc, argv );
 	exit_status = colm_delete_program( prg );
+
+	if ( timeReport ) {
+		recordPhase( phaseTimes, "rlhc", "", argc > 1 ? argv[1] : "", start, 0 );
+		writeTimeReport();
+	}
+
 	return exit_status;
 }
 
+/* Frontend and rlhc back to back in one job. The frontend runs in a child
+ * and writes the intermediate into a pipe that rlhc reads from as it is
+ * produced. If the frontend fails, whatever rlhc wrote is removed. Without
+ * fork, or when the intermediate is to be kept, it goes through the file. */
+int InputData::runPipeline( int argc, const char **argv )
+{
+#if defined(HAVE_SYS_WAIT_H) && !defined(_WIN32)
+	int fds[2];
+	if ( !noFork && !saveTemps && pipe( fds ) == 0 ) {
+		pid_t pid = fork();
+		if ( pid == 0 ) {
+			close( fds[0] );
+
+			std::ostringstream outputName;
+			outputName << "/dev/fd/" << fds[1];
+			outputPath = outputName.str();
+
+			int es = 0;
+			try {
+				es = runFrontend( 0, 0 );
+			}
+			catch ( const AbortCompile &ac ) {
+				es = ac.code;
+			}
+
+			close( fds[1] );
+			exit( es );
+		}
+
+		close( fds[1] );
+
+		if ( pid < 0 ) {
+			close( fds[0] );
+			error() << "could not fork the frontend: " << strerror(errno) << endp;
+		}
+
+		std::ostringstream inputName;
+		inputName << "/dev/fd/" << fds[0];
+		std::string name = inputName.str();
+
+		/* rlhc <input> <output> */
+		const char *_argv[] = { "rlhc",
+				name.c_str(),
+				origOutputFileName.c_str(), 0 };
+
+		int es = runRlhc( 3, _argv );
+
+		/* If rlhc stopped early the frontend gets SIGPIPE on its next
+		 * write, which is reported as rlhc's failure. */
+		close( fds[0] );
+
+		int status = 0;
+		waitpid( pid, &status, 0 );
+
+		int fes = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+		if ( fes != 0 ) {
+			unlink( origOutputFileName.c_str() );
+
+			if ( es == 0 && WIFSIGNALED(status) )
+				error() << "frontend stopped by signal: " << WTERMSIG(status) << endl;
+
+			return es != 0 ? es : fes;
+		}
+
+		return es;
+	}
+#endif
+
+	/* Go through the intermediate file. */
+	int es = runFrontend( 0, 0 );
+	if ( es != 0 )
+		return es;
+
+	/* rlhc <input> <output> */
+	const char *_argv[] = { "rlhc",
+			genOutputFileName.c_str(),
+			origOutputFileName.c_str(), 0 };
+
+	return runRlhc( 3, _argv );
+}
+
 /* Run a job (frontend or backend). If we want forks then we return the result
  * via the process's exit code. otherwise it comes back on the stack. */
 int InputData::runJob( const char *what, IdProcess idProcess, int argc, const char **argv )
@@ -1339,6 +2256,15 @@ int InputData::main( int argc, const char **argv )
 	int code = 0;
 	try {
 		parseArgs( argc, argv );
+		if ( batchMode() )
+			return runBatch( argc, argv, &InputData::main );
+
+		if ( trainHistogramPath != 0 && inputFileName == 0 ) {
+			if ( errorCount > 0 )
+				abortCompile( 1 );
+			return writeTrainedHistogram();
+		}
+
 		checkArgs();
 		if ( !generateDot )
 			makeDefaultFileName();
@@ -1358,10 +2284,23 @@ int InputData::rlhcMain( int argc, const char **argv )
 	int code = 0;
 	try {
 		parseArgs( argc, argv );
+		if ( batchMode() )
+			return runBatch( argc, argv, &InputData::rlhcMain );
+
+		if ( trainHistogramPath != 0 && inputFileName == 0 ) {
+			if ( errorCount > 0 )
+				abortCompile( 1 );
+			return writeTrainedHistogram();
+		}
+
 		checkArgs();
 		makeDefaultFileName();
 		makeTranslateOutputFileName();
 
+		/* A single job, forked once unless --no-fork is also given. */
+		if ( pipeline )
+			return runJob( "pipeline", &InputData::runPipeline, 0, 0 );
+
 		int es = runJob( "frontend", &InputData::runFrontend, 0, 0 );
 
 		if ( es != 0 )
@@ -36,6 +36,7 @@ struct CondAp;
 struct ActionTable;
 struct Section;
 struct LangFuncs;
+struct FsmAp;
 
 void translatedHostData( ostream &out, const string &data );
 
@@ -97,6 +98,31 @@ typedef DList<InputItem> InputItemList;
 typedef DList<IncItem> IncItemList;
 typedef Vector<const char *> ArgsVector;
 
+/* Lines of the input file that a %%{ }%% block spans. */
+struct SectionBlock
+{
+	SectionBlock()
+		: startLine(0), endLine(0) {}
+
+	SectionBlock( int startLine, int endLine )
+		: startLine(startLine), endLine(endLine) {}
+
+	int startLine;
+	int endLine;
+};
+
+/* Lines of a %%{ }%% block that an include statement pulled into a
+ * section. The file may be the input file itself. */
+struct IncludedBlock
+{
+	IncludedBlock( const std::string &fileName, int startLine, int endLine )
+		: fileName(fileName), startLine(startLine), endLine(endLine) {}
+
+	std::string fileName;
+	int startLine;
+	int endLine;
+};
+
 struct Section
 {
 	Section( std::string sectionName )
@@ -111,6 +137,12 @@ struct Section
 	 * we pass over this item we are free to clear away the parse tree. */
 	InputItem *lastReference;
 
+	/* The blocks that make up the section, in input order. */
+	Vector<SectionBlock> blocks;
+
+	/* The blocks its include statements pulled in, at any depth. */
+	std::vector<IncludedBlock> included;
+
 	Section *prev, *next;
 };
 
@@ -167,6 +199,79 @@ struct IncludeRec
 
 };
 
+/* The contents of a file, mapped into memory where the system allows and
+ * read in otherwise. Used by the compilation cache. */
+struct InputMap
+{
+	InputMap()
+		: data(0), length(0), mapped(false), buf(0) {}
+
+	~InputMap()
+		{ close(); }
+
+	bool open( const char *fileName );
+	void close();
+
+	const char *data;
+	size_t length;
+	bool mapped;
+
+private:
+	char *buf;
+
+	InputMap( const InputMap & );
+	InputMap &operator=( const InputMap & );
+};
+
+/* State of the output filter on either side of a write statement. */
+struct CacheFilterState
+{
+	CacheFilterState()
+		: line(0), level(0), indent(false), singleIndent(false) {}
+
+	int line;
+	int level;
+	bool indent;
+	bool singleIndent;
+};
+
+/* The output of one write statement, exactly as it went to the output file. */
+struct CachedWrite
+{
+	CachedWrite()
+		: start(0), end(0) {}
+
+	std::string args;
+	CacheFilterState before;
+	CacheFilterState after;
+
+	/* Offsets in the output file. Used only while recording. */
+	long start, end;
+	std::string data;
+};
+
+typedef std::vector<CachedWrite> CachedWriteVect;
+
+/* A section's entry in the compilation cache. When loaded (hit) the section
+ * is not compiled and its writes are spliced into the output. When stored,
+ * the writes are recorded and saved once the output is complete. Sections
+ * compiled by --jobs children come back in the same form. */
+struct SectionCache
+{
+	SectionCache()
+		: hit(false), store(true), job(false), nextWrite(0) {}
+
+	std::string key;
+	bool hit;
+	bool store;
+
+	/* The writes came from a --jobs child rather than the cache directory. */
+	bool job;
+
+	CachedWriteVect writes;
+	long nextWrite;
+};
+
 struct InputData
 :
 	public FsmGbl
@@ -208,9 +313,22 @@ struct InputData
 		varBackend(false),
 		histogramFn(0),
 		histogram(0),
+		trainHistogramPath(0),
 		input(0),
 		forceVar(false),
 		noFork(false),
+		jobs(1),
+		jobFallbacks(0),
+		pipeline(false),
+		cacheDir(0),
+		cacheHits(0),
+		cacheMisses(0),
+		timeReport(false),
+		opReport(0),
+		memoryLimit(0),
+		lowMemory(false),
+		emitMs(0),
+		batchFile(0),
 		utf8BomPresent(false)
 	{}
 
@@ -298,6 +416,9 @@ struct InputData
 	const char *histogramFn;
 	double *histogram;
 
+	/* Sample input to derive the breadth check histogram from. */
+	const char *trainHistogramPath;
+
 	const char *input;
 
 	Vector<const char**> streamFileNames;
@@ -305,6 +426,57 @@ struct InputData
 	bool forceVar;
 	bool noFork;
 
+	/* Number of child processes to compile sections in. A value of one keeps
+	 * the original behaviour of compiling each section at its last reference.
+	 * Also the number of batch entries run at once. */
+	long jobs;
+
+	/* Sections whose output from a child could not be used, and which were
+	 * compiled again in the parent. */
+	long jobFallbacks;
+
+	/* Run the frontend and rlhc as one job, passing the intermediate through
+	 * a pipe rather than a file. When set, outputPath is where the output is
+	 * actually opened, if it differs from the output file name. */
+	bool pipeline;
+	std::string outputPath;
+
+	/* Compilation cache. */
+	const char *cacheDir;
+	long cacheHits;
+	long cacheMisses;
+	std::string progName;
+
+	/* Per-phase timings, written out as JSON lines by each process that
+	 * records them. Sections keep their own until the report is written. */
+	bool timeReport;
+	PhaseTimeVect phaseTimes;
+
+	/* Number of operators to show in the report of the largest graphs
+	 * produced by each operator. Zero disables the report. */
+	long opReport;
+
+	/* Bytes the process may use while building graphs. Checked against the
+	 * current resident size as operators finish, each time enough states
+	 * have been built since the last check. An allocation limit above it
+	 * stops a single operator that runs away. Both apply to the compiling
+	 * process, which under --jobs is the child compiling one section, and
+	 * are lifted once the frontend is done. */
+	long long memoryLimit;
+
+	/* Free each section as soon as its last write has gone out. */
+	bool lowMemory;
+
+	/* Time spent writing input items to the output, for -s. */
+	double emitMs;
+
+	/* Batch compilation. Each input file given on the command line, and each
+	 * line of the manifest, is compiled as its own job. The argv positions
+	 * of the input files are kept so they can be dropped from the arguments
+	 * shared by every job. */
+	const char *batchFile;
+	std::vector<int> inputArgs;
+
 	/* Did the input file have a byte order mark? */
 	bool utf8BomPresent;
 
@@ -329,6 +501,34 @@ struct InputData
 	void writeLanguage( std::ostream &out );
 
 	bool checkLastRef( InputItem *ii );
+	void releaseFlushed( InputItem *ii );
+	bool compileSection( ParseData *pd );
+	int compileJob( ParseData *pd, const std::string &entryName );
+	void compileAllSections();
+
+	void makeCacheKey( ParseData *pd, const InputMap &input,
+			const std::vector<size_t> &lines, std::string &key );
+	std::string cacheFileName( const std::string &key );
+	bool readCacheEntry( const std::string &fileName, SectionCache *cache );
+	void writeCacheEntry( const std::string &fileName, SectionCache *cache );
+	void loadCache();
+	void storeCache();
+	bool cacheLineIndependent();
+	bool replayCachedWrite( InputItem *ii );
+	bool cacheFallback( InputItem *ii );
+	void writeCached( InputItem *ii );
+	void recordWrite( InputItem *ii, SectionCache *cache );
+	bool sliceWrites( const InputMap &output, CachedWriteVect &writes );
+
+	double phaseClock();
+	long peakRssKb();
+	long currentRssKb();
+	void limitMemory();
+	void unlimitMemory();
+	void recordPhase( PhaseTimeVect &times, const char *phase,
+			const std::string &section, const std::string &name,
+			double start, FsmAp *fsm );
+	void writeTimeReport();
 
 	void parseKelbt();
 	void processDot();
@@ -338,6 +538,9 @@ struct InputData
 
 	void loadHistogram();
 	void defaultHistogram();
+	void trainHistogram();
+	void trainHistogramFrom( const std::string &path, double *counts, long &files );
+	int writeTrainedHistogram();
 
 	void parseArgs( int argc, const char **argv );
 	void checkArgs();
@@ -358,6 +561,7 @@ struct InputData
 
 	int runFrontend( int argc, const char **argv );
 	int runRlhc( int argc, const char **argv );
+	int runPipeline( int argc, const char **argv );
 
 	typedef int (InputData::*IdProcess)( int argc, const char **argv );
 
@@ -365,6 +569,11 @@ struct InputData
 			int argc, const char **argv );
 
 	int rlhcMain( int argc, const char **argv );
+
+	/* Batch compilation. */
+	bool batchMode() { return batchFile != 0 || inputArgs.size() > 1; }
+	int runBatch( int argc, const char **argv, IdProcess entry );
+	int runBatchEntry( IdProcess entry, const std::vector<std::string> &args );
 };
 
 
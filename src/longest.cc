@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <vector>
 #include <inputdata.h>
 
 /* Parsing. */
@@ -33,20 +34,46 @@
 #include "parsetree.h"
 #include "parsedata.h"
 
+/* A longest match item and a state it has just been added to. The item still
+ * needs to be carried to the states following it. */
+struct LmItemPush
+{
+	LmItemPush( StateAp *state, LongestMatchPart *item )
+		: state(state), item(item) {}
+
+	StateAp *state;
+	LongestMatchPart *item;
+};
+
+typedef std::vector<LmItemPush> LmItemWork;
+
+/* Carry an item into a state that follows one holding it. Final states stop
+ * the fill, the same as markReachableFromHereStopFinal. */
+static void lmItemCarry( LmItemWork &work, StateAp *toState, LongestMatchPart *item )
+{
+	if ( toState != 0 && !toState->isFinState() && toState->lmItemSet.insert( item ) != 0 )
+		work.push_back( LmItemPush( toState, item ) );
+}
+
+/* Start a fill at a state. The state itself takes the item, final or not. */
+static void lmItemSource( LmItemWork &work, StateAp *state, LongestMatchPart *item )
+{
+	if ( state->lmItemSet.insert( item ) != 0 )
+		work.push_back( LmItemPush( state, item ) );
+}
+
 void LongestMatch::runLongestMatch( ParseData *pd, FsmAp *graph )
 {
-	graph->markReachableFromHereStopFinal( graph->startState );
-	for ( StateList::Iter ms = graph->stateList; ms.lte(); ms++ ) {
-		if ( ms->stateBits & STB_ISMARKED ) {
-			ms->lmItemSet.insert( 0 );
-			ms->stateBits &= ~ STB_ISMARKED;
-		}
-	}
+	/* Fill the item sets. Every state gets the items of the fills that reach
+	 * it: the null item from the start state, and the first item of each
+	 * non-empty lmAction table from the state the transition goes to. All
+	 * fills run together on one worklist of (state, item) pairs. A pair is
+	 * only pushed when the item is new to the state, so each one is expanded
+	 * once, rather than doing a reachability walk and a scan of the state
+	 * list for every lmAction table. */
+	LmItemWork work;
+	lmItemSource( work, graph->startState, 0 );
 
-	/* Transfer the first item of non-empty lmAction tables to the item sets
-	 * of the states that follow. Exclude states that have no transitions out.
-	 * This must happen on a separate pass so that on each iteration of the
-	 * next pass we have the item set entries from all lmAction tables. */
 	for ( StateList::Iter st = graph->stateList; st.lte(); st++ ) {
 		for ( TransList::Iter trans = st->outList; trans.lte(); trans++ ) {
 			if ( trans->plain() ) {
@@ -59,16 +86,8 @@ void LongestMatch::runLongestMatch( ParseData *pd, FsmAp *graph )
 					/* Can only optimize this if there are no transitions out.
 					 * Note there can be out transitions going nowhere with
 					 * actions and they too must inhibit this optimization. */
-					if ( toState->outList.length() > 0 ) {
-						/* Fill the item sets. */
-						graph->markReachableFromHereStopFinal( toState );
-						for ( StateList::Iter ms = graph->stateList; ms.lte(); ms++ ) {
-							if ( ms->stateBits & STB_ISMARKED ) {
-								ms->lmItemSet.insert( lmAct->value );
-								ms->stateBits &= ~ STB_ISMARKED;
-							}
-						}
-					}
+					if ( toState->outList.length() > 0 )
+						lmItemSource( work, toState, lmAct->value );
 				}
 			}
 			else {
@@ -82,22 +101,28 @@ void LongestMatch::runLongestMatch( ParseData *pd, FsmAp *graph )
 						/* Can only optimize this if there are no transitions out.
 						 * Note there can be out transitions going nowhere with
 						 * actions and they too must inhibit this optimization. */
-						if ( toState->outList.length() > 0 ) {
-							/* Fill the item sets. */
-							graph->markReachableFromHereStopFinal( toState );
-							for ( StateList::Iter ms = graph->stateList; ms.lte(); ms++ ) {
-								if ( ms->stateBits & STB_ISMARKED ) {
-									ms->lmItemSet.insert( lmAct->value );
-									ms->stateBits &= ~ STB_ISMARKED;
-								}
-							}
-						}
+						if ( toState->outList.length() > 0 )
+							lmItemSource( work, toState, lmAct->value );
 					}
 				}
 			}
 		}
 	}
 
+	while ( work.size() > 0 ) {
+		LmItemPush push = work.back();
+		work.pop_back();
+
+		for ( TransList::Iter trans = push.state->outList; trans.lte(); trans++ ) {
+			if ( trans->plain() )
+				lmItemCarry( work, trans->tdap()->toState, push.item );
+			else {
+				for ( CondList::Iter cond = trans->tcap()->condList; cond.lte(); cond++ )
+					lmItemCarry( work, cond->toState, push.item );
+			}
+		}
+	}
+
 	/* The lmItem sets are now filled, telling us which longest match rules
 	 * can succeed in which states. First determine if we need to make sure
 	 * act is defaulted to zero. We need to do this if there are any states
@@ -426,44 +451,44 @@ void LongestMatch::eliminateNfaActions( ParseData *pd, FsmAp *fsm )
 	 * Once the union is complete we can optimize by advancing actions so they
 	 * happen sooner, then draw the final transitions back to the start state.
 	 * First step is to remove epsilon transitions that will never be taken. 
+	 *
+	 * An epsilon transition into a final state created for matching a pattern
+	 * that cannot fail is one we never backtrack past, so all of the source
+	 * state's epsilon transitions ordered before it can go. Removing them
+	 * never changes which other transitions qualify, so it is enough to find
+	 * the last such transition out of each state and cut everything before
+	 * it, in one pass.
 	 */
-	bool modified = true;
-	while ( modified ) {
-		modified = false;
-
-		for ( StateList::Iter st = fsm->stateList; st.lte(); st++ ) {
-			/* Check if the nfa parts list is non-empty (meaning we have a final
-			 * state created for matching a pattern). */
-			if ( st->lmNfaParts.length() > 0 && st->nfaIn != 0 ) {
-				/* Check if it can fail. If it can fail, then we cannot
-				 * eliminate the prior candidates. If it can't fail then it is
-				 * acceptable to eliminate the prior NFA transitions because we
-				 * will never backtrack to follow them.*/ 
-				if ( matchCanFail( pd, fsm, st ) )
-					continue;
-
-				for ( NfaInList::Iter in = *st->nfaIn; in.lte(); in++ ) {
-					StateAp *fromState = in->fromState;
-					/* Go forward until we get to the in-transition that cannot
-					 * fail. Stop there because we are interested in what's
-					 * before. */
-					for ( NfaTransList::Iter to = *fromState->nfaOut; to.lte(); to++ ) {
-						if ( to->order < in->order ) {
-							/* Can nuke the epsilon transition that we will never
-							 * follow. */
-							fsm->detachFromNfa( fromState, to->toState, to );
-							fromState->nfaOut->detach( to );
-							delete to;
-
-							modified = true;
-							goto restart;
-						}
-					}
-				}
+	for ( StateList::Iter st = fsm->stateList; st.lte(); st++ ) {
+		if ( st->nfaOut == 0 )
+			continue;
+
+		NfaTrans *cut = 0;
+		for ( NfaTransList::Iter to = *st->nfaOut; to.lte(); to++ ) {
+			StateAp *toState = to->toState;
+			if ( toState->lmNfaParts.length() > 0 &&
+					!matchCanFail( pd, fsm, toState ) &&
+					( cut == 0 || to->order > cut->order ) )
+			{
+				cut = to;
 			}
 		}
 
-		restart: {}
+		if ( cut == 0 )
+			continue;
+
+		NfaTrans *to = st->nfaOut->head;
+		while ( to != 0 ) {
+			NfaTrans *next = to->next;
+			if ( to->order < cut->order ) {
+				/* Can nuke the epsilon transition that we will never
+				 * follow. */
+				fsm->detachFromNfa( st, to->toState, to );
+				st->nfaOut->detach( to );
+				delete to;
+			}
+			to = next;
+		}
 	}
 }
 
@@ -107,28 +107,100 @@ HostType *findAlphTypeInternal( const HostLang *hostLang, const char *s1 )
 	return 0;
 }
 
+/* Testing eight bytes at a time for the characters the filter counts. Most of
+ * the generated output is table data with none of them. */
+typedef unsigned long long FilterWord;
+
+static const FilterWord filterOnes = 0x0101010101010101ULL;
+static const FilterWord filterHighs = 0x8080808080808080ULL;
+
+static inline FilterWord hasZeroByte( FilterWord w )
+{
+	return ( w - filterOnes ) & ~w & filterHighs;
+}
+
+static inline bool hasCounted( FilterWord w )
+{
+	return ( hasZeroByte( w ^ ( filterOnes * '\n' ) ) |
+			hasZeroByte( w ^ ( filterOnes * '{' ) ) |
+			hasZeroByte( w ^ ( filterOnes * '}' ) ) ) != 0;
+}
+
+output_filter::output_filter( const char *fileName )
+:
+	fileName(fileName),
+	line(1),
+	level(0),
+	indent(false),
+	singleIndent(false),
+	buffer(new char[BufferSize])
+{
+	/* Large blocks to the file, rather than the default few kilobytes. Must
+	 * happen before the file is opened. */
+	setbuf( buffer, BufferSize );
+}
+
+output_filter::~output_filter()
+{
+	/* The buffer must be flushed while it still exists. */
+	close();
+	delete[] buffer;
+}
+
 std::streamsize output_filter::countAndWrite( const char *s, std::streamsize n )
 {
-	for ( int i = 0; i < n; i++ ) {
-		switch ( s[i] ) {
-		case '\n':
-			line += 1;
-			break;
-		case '{':
-			/* If we detec an open block then eliminate the single-indent
-			 * addition, which is to account for single statements. */
-			singleIndent = false;
-			level += 1;
-			break;
-		case '}':
-			level -= 1;
-			break;
+	std::streamsize i = 0;
+	while ( i < n ) {
+		std::streamsize len = sizeof(FilterWord);
+		if ( n - i >= len ) {
+			FilterWord w;
+			memcpy( &w, s + i, sizeof(w) );
+			if ( !hasCounted( w ) ) {
+				i += len;
+				continue;
+			}
+		}
+		else {
+			len = n - i;
+		}
+
+		for ( std::streamsize e = i + len; i < e; i++ ) {
+			switch ( s[i] ) {
+			case '\n':
+				line += 1;
+				break;
+			case '{':
+				/* If we detec an open block then eliminate the single-indent
+				 * addition, which is to account for single statements. */
+				singleIndent = false;
+				level += 1;
+				break;
+			case '}':
+				level -= 1;
+				break;
+			}
 		}
 	}
 
 	return std::filebuf::xsputn( s, n );
 }
 
+/* Indentation in one write. Tabs are not counted, so they go straight
+ * out. */
+void output_filter::writeTabs( int tabs )
+{
+	static const char tabData[] =
+			"\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t"
+			"\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+	const int chunk = sizeof(tabData) - 1;
+
+	while ( tabs > 0 ) {
+		int len = tabs < chunk ? tabs : chunk;
+		std::filebuf::xsputn( tabData, len );
+		tabs -= len;
+	}
+}
+
 bool openSingleIndent( const char *s, int n )
 {
 	if ( n >= 3 && memcmp( s, "if ", 3 ) == 0 )
@@ -154,7 +226,6 @@ int output_filter::sync( )
 std::streamsize output_filter::xsputn( const char *s, std::streamsize n )
 {
 	std::streamsize ret = n;
-	int l;
 
 restart:
 	if ( indent ) {
@@ -184,8 +255,7 @@ restart:
 			if ( *s != '#' ) {
 				/* Found some data, print the indentation and turn off indentation
 				 * mode. */
-				for ( l = 0; l < tabs; l++ )
-					countAndWrite( "\t", 1 );
+				writeTabs( tabs );
 			}
 
 
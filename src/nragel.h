@@ -3,6 +3,8 @@
 
 #include <libfsm/common.h>
 #include <libfsm/ragel.h>
+#include <string>
+#include <vector>
 
 struct HostLang;
 
@@ -49,25 +51,29 @@ class output_filter
 	public std::filebuf
 {
 public:
-	output_filter( const char *fileName )
-	:
-		fileName(fileName),
-		line(1),
-		level(0),
-		indent(false),
-		singleIndent(false)
-	{}
+	output_filter( const char *fileName );
+	~output_filter();
 
 	virtual int sync();
 	virtual std::streamsize xsputn( const char* s, std::streamsize n );
 
 	std::streamsize countAndWrite( const char* s, std::streamsize n );
+	void writeTabs( int tabs );
+
+	/* Write without tracking lines or indentation. The caller is responsible
+	 * for setting the state to what it should be afterwards. */
+	std::streamsize writeRaw( const char* s, std::streamsize n )
+		{ return std::filebuf::xsputn( s, n ); }
 
 	const char *fileName;
 	int line;
 	int level;
 	bool indent;
 	bool singleIndent;
+
+private:
+	static const int BufferSize = 256 * 1024;
+	char *buffer;
 };
 
 class cfilebuf : public std::streambuf
@@ -112,6 +118,30 @@ public:
 	cfilebuf *b;
 };
 
+/* One timed phase of the compile, for --time-report. The state and
+ * transition counts are -1 when the phase has no graph to show. */
+struct PhaseTime
+{
+	PhaseTime( const char *phase, const std::string &section,
+			const std::string &name, double start, double wallMs,
+			long peakRssKb, long states, long trans )
+	:
+		phase(phase), section(section), name(name), start(start),
+		wallMs(wallMs), peakRssKb(peakRssKb), states(states), trans(trans)
+	{}
+
+	const char *phase;
+	std::string section;
+	std::string name;
+	double start;
+	double wallMs;
+	long peakRssKb;
+	long states;
+	long trans;
+};
+
+typedef std::vector<PhaseTime> PhaseTimeVect;
+
 const char *findFileExtension( const char *stemFile );
 const char *fileNameFromStem( const char *stemFile, const char *suffix );
 
@@ -379,6 +379,36 @@ FsmAp *makeBuiltin( BuiltinMachine builtin, ParseData *pd )
 		retFsm = digit;
 		break;
 	}
+	case BT_Utf8Any: {
+		/* Any UTF-8 encoded code point, excluding surrogates. */
+		static const UnicodeRange all[] = { { 0, 0x10ffff } };
+		retFsm = utf8ClassFsm( pd, all, 1 );
+		break;
+	}
+	case BT_Utf8Letter: {
+		retFsm = utf8ClassFsm( pd, unicodeLetter, unicodeLetterLen );
+		break;
+	}
+	case BT_Utf8Upper: {
+		retFsm = utf8ClassFsm( pd, unicodeUpper, unicodeUpperLen );
+		break;
+	}
+	case BT_Utf8Lower: {
+		retFsm = utf8ClassFsm( pd, unicodeLower, unicodeLowerLen );
+		break;
+	}
+	case BT_Utf8Digit: {
+		retFsm = utf8ClassFsm( pd, unicodeDigit, unicodeDigitLen );
+		break;
+	}
+	case BT_Utf8Alnum: {
+		retFsm = utf8ClassFsm( pd, unicodeAlnum, unicodeAlnumLen );
+		break;
+	}
+	case BT_Utf8Space: {
+		retFsm = utf8ClassFsm( pd, unicodeSpace, unicodeSpaceLen );
+		break;
+	}
 	case BT_Lambda: {
 		retFsm = FsmAp::lambdaFsm( pd->fsmCtx );
 		break;
@@ -441,7 +471,19 @@ ParseData::ParseData( InputData *id, string sectionName,
 	nextEpsilonResolvedLink(0),
 	nextLongestMatchId(1),
 	nextRepId(1),
-	cgd(0)
+	cgd(0),
+	refCacheHits(0),
+	refCacheMisses(0),
+	compiled(false),
+	compileSuccess(false),
+	cache(0),
+	opChildMs(0),
+	curOpDef(0),
+	curOpLoc(0),
+	memoryLimitHit(false),
+	memoryLimitAddedKb(0),
+	memoryCheckKb(0),
+	memoryCheckStates(0)
 {
 	fsmCtx = new FsmCtx( id );
 
@@ -456,7 +498,9 @@ ParseData::ParseData( InputData *id, string sectionName,
 /* Clean up the data collected during a parse. */
 ParseData::~ParseData()
 {
+	clearRefCache();
 	graphDict.empty();
+	shadowedBuiltins.empty();
 	fsmCtx->actionList.empty();
 
 	if ( fsmCtx->nameIndex != 0 )
@@ -468,6 +512,9 @@ ParseData::~ParseData()
 		delete exportsRootName;
 
 	delete fsmCtx;
+
+	if ( cache != 0 )
+		delete cache;
 }
 
 ifstream *InputData::tryOpenInclude( const char **pathChecks, long &found )
@@ -648,6 +695,121 @@ void ParseData::resetNameScope( const NameFrame &frame )
 	localNameScope = frame.prevLocalScope;
 }
 
+/* Start timing an operator. Time spent in operators nested below is
+ * collected separately so each gets only its own share. */
+OpFrame ParseData::enterOp( VarDef *def, const InputLoc &loc )
+{
+	OpFrame retFrame;
+	retFrame.start = id->opReport > 0 ? id->phaseClock() : 0;
+	if ( id->memoryLimit > 0 && memoryCheckKb == 0 )
+		memoryCheckKb = id->currentRssKb();
+	retFrame.startKb = memoryCheckKb;
+	retFrame.prevChildMs = opChildMs;
+	retFrame.prevDef = curOpDef;
+	retFrame.prevLoc = curOpLoc;
+
+	opChildMs = 0;
+	if ( def != 0 )
+		curOpDef = def;
+	curOpLoc = &loc;
+	return retFrame;
+}
+
+/* States built by operators between reads of the resident size. */
+static const long memoryCheckStatesMax = 4096;
+
+/* Finish an operator. If the process has gone over the memory limit the
+ * result is dropped and the walk fails from here on up. The resident size is
+ * read once the operators finished since the last read have built enough
+ * states, so the operator reported is the one that was finishing then. */
+void ParseData::leaveOp( const OpFrame &frame, const std::string &op, FsmRes &res )
+{
+	if ( id->memoryLimit > 0 && res.success() ) {
+		memoryCheckStates += res.fsm->stateList.length();
+		if ( memoryCheckStates >= memoryCheckStatesMax ) {
+			memoryCheckStates = 0;
+			memoryCheckKb = id->currentRssKb();
+			if ( memoryCheckKb * 1024LL > id->memoryLimit ) {
+				delete res.fsm;
+				res = FsmRes( FsmRes::InternalError() );
+				memoryLimitHit = true;
+				memoryLimitLoc = *curOpLoc;
+				memoryLimitAddedKb = memoryCheckKb - frame.startKb;
+			}
+		}
+	}
+
+	if ( id->opReport > 0 ) {
+		double ms = id->phaseClock() - frame.start;
+
+		long states = -1, trans = -1;
+		if ( res.success() ) {
+			states = res.fsm->stateList.length();
+			trans = countTransitions( res.fsm );
+		}
+
+		opStats.push_back( OpStat( *curOpLoc, op,
+				curOpDef != 0 ? curOpDef->name : std::string(),
+				states, trans, ms - opChildMs ) );
+
+		opChildMs = frame.prevChildMs + ms;
+	}
+
+	curOpDef = frame.prevDef;
+	curOpLoc = frame.prevLoc;
+}
+
+/* Failed operators first, then by the size of the graph produced. */
+struct CmpOpStat
+{
+	static int compare( const OpStat &os1, const OpStat &os2 )
+	{
+		if ( ( os1.states < 0 ) != ( os2.states < 0 ) )
+			return os1.states < 0 ? -1 : 1;
+		else if ( os1.states > os2.states )
+			return -1;
+		else if ( os1.states < os2.states )
+			return 1;
+		else if ( os1.trans > os2.trans )
+			return -1;
+		else if ( os1.trans < os2.trans )
+			return 1;
+		return 0;
+	}
+};
+
+void ParseData::reportOps()
+{
+	if ( opStats.size() > 0 ) {
+		MergeSort<OpStat, CmpOpStat> mergeSort;
+		mergeSort.sort( &opStats[0], opStats.size() );
+	}
+
+	id->stats() << "op-report\t" << sectionName << endl;
+
+	long n = 0;
+	for ( OpStatVect::iterator os = opStats.begin();
+			os != opStats.end() && n < id->opReport; os++, n++ )
+	{
+		std::ostringstream line;
+		line << "op\t";
+		if ( os->states < 0 )
+			line << "failed\t-";
+		else
+			line << os->states << "\t" << os->trans;
+
+		line << "\t" << std::fixed << std::setprecision(3) << os->ms <<
+				"ms\t" << os->op << "\t" <<
+				( !os->def.empty() ? os->def : "<ANON>" ) << "\t" <<
+				( os->loc.fileName != 0 ? os->loc.fileName : "" ) <<
+				":" << os->loc.line << ":" << os->loc.col;
+
+		id->stats() << line.str() << endl;
+	}
+
+	opStats.clear();
+}
+
 
 void ParseData::unsetObsoleteEntries( FsmAp *graph )
 {
@@ -936,17 +1098,32 @@ void ParseData::makeNameTree( GraphDictEl *dictEl )
 }
 
 
-void ParseData::createBuiltin( const char *name, BuiltinMachine builtin )
+void ParseData::createBuiltin( const char *name, BuiltinMachine builtin, bool weak )
 {
 	Expression *expression = new Expression( builtin );
 	Join *join = new Join( expression );
 	MachineDef *machineDef = new MachineDef( join );
 	VarDef *varDef = new VarDef( name, machineDef );
 	GraphDictEl *graphDictEl = new GraphDictEl( name, varDef );
+	graphDictEl->isWeak = weak;
 	graphDict.insert( graphDictEl );
 }
 
-/* Initialize the graph dict with builtin types. */
+/* Take a weak builtin out of the graph dict so a definition can take its
+ * name. Returns false if the name is not a weak builtin. */
+bool ParseData::shadowBuiltin( const std::string &name )
+{
+	GraphDictEl *gdEl = graphDict.find( name );
+	if ( gdEl == 0 || !gdEl->isWeak )
+		return false;
+
+	graphDict.detach( gdEl );
+	shadowedBuiltins.append( gdEl );
+	return true;
+}
+
+/* Initialize the graph dict with builtin types. The utf8 classes came later
+ * and are weak, so machines that already define those names keep working. */
 void ParseData::initGraphDict( )
 {
 	createBuiltin( "any", BT_Any );
@@ -963,6 +1140,13 @@ void ParseData::initGraphDict( )
 	createBuiltin( "punct", BT_Punct );
 	createBuiltin( "space", BT_Space );
 	createBuiltin( "xdigit", BT_Xdigit );
+	createBuiltin( "utf8_any", BT_Utf8Any, true );
+	createBuiltin( "utf8_letter", BT_Utf8Letter, true );
+	createBuiltin( "utf8_upper", BT_Utf8Upper, true );
+	createBuiltin( "utf8_lower", BT_Utf8Lower, true );
+	createBuiltin( "utf8_digit", BT_Utf8Digit, true );
+	createBuiltin( "utf8_alnum", BT_Utf8Alnum, true );
+	createBuiltin( "utf8_space", BT_Utf8Space, true );
 	createBuiltin( "null", BT_Lambda );
 	createBuiltin( "zlen", BT_Lambda );
 	createBuiltin( "empty", BT_Empty );
@@ -1220,7 +1404,14 @@ void ParseData::reportBreadthResults( BreadthResult *breadth )
 
 void ParseData::reportAnalysisResult( FsmRes &res )
 {
-	if ( res.type == FsmRes::TypeTooManyStates )
+	if ( memoryLimitHit ) {
+		analysisResult( 2, 0, "memory-limit" );
+		id->error(memoryLimitLoc) << "memory limit of " << id->memoryLimit <<
+				" bytes exceeded while applying this operator (it added " <<
+				memoryLimitAddedKb << " kB)" << endl;
+	}
+
+	else if ( res.type == FsmRes::TypeTooManyStates )
 		analysisResult( 1, 0, "too-many-states" );
 
 	else if ( res.type == FsmRes::TypeCondCostTooHigh )
@@ -1240,12 +1431,21 @@ FsmRes ParseData::makeInstance( GraphDictEl *gdNode )
 	if ( id->stateLimit > 0 )
 		fsmCtx->stateLimit = id->stateLimit;
 
+	double start = id->timeReport ? id->phaseClock() : 0;
+
 	/* Build the graph from a walk of the parse tree. */
+	curOpLoc = &gdNode->loc;
 	FsmRes graph = gdNode->value->walk( this );
+	curOpLoc = 0;
 
 	if ( id->stateLimit > 0 )
 		fsmCtx->stateLimit = FsmCtx::STATE_UNLIMITED;
 
+	if ( id->timeReport ) {
+		id->recordPhase( phaseTimes, "makeInstance", sectionName,
+				gdNode->key, start, graph.success() ? graph.fsm : 0 );
+	}
+
 	/* Perform the breadth computation. This does not affect the FSM result. We
 	 * compute and print and move on. Higher up we catch the checkBreadth flag
 	 * and stop output. */
@@ -1266,8 +1466,17 @@ FsmRes ParseData::makeInstance( GraphDictEl *gdNode )
 		return graph;
 	}
 
+	/* Minimization at the end, if that is the setting, and state sorting.
+	 * With minimization after operations, that is part of the walk. */
+	start = id->timeReport ? id->phaseClock() : 0;
+
 	fsmCtx->finalizeInstance( graph.fsm );
 
+	if ( id->timeReport ) {
+		id->recordPhase( phaseTimes, "minimize", sectionName,
+				gdNode->key, start, graph.fsm );
+	}
+
 	return graph;
 }
 
@@ -1315,9 +1524,16 @@ FsmRes ParseData::makeSpecific( GraphDictEl *gdNode )
 
 FsmRes ParseData::makeAll()
 {
+	double start = id->timeReport ? id->phaseClock() : 0;
+
 	/* Build the name tree and supporting data structures. */
 	makeNameTree( 0 );
 
+	if ( id->timeReport ) {
+		id->recordPhase( phaseTimes, "makeNameTree", sectionName, "", start, 0 );
+		start = id->phaseClock();
+	}
+
 	/* Resove name references in the tree. */
 	initNameWalk();
 	for ( GraphList::Iter glel = instanceList; glel.lte(); glel++ )
@@ -1326,6 +1542,9 @@ FsmRes ParseData::makeAll()
 	/* Resolve action code name references. */
 	resolveActionNameRefs();
 
+	if ( id->timeReport )
+		id->recordPhase( phaseTimes, "resolveNameRefs", sectionName, "", start, 0 );
+
 	/* Force name references to the top level instantiations. */
 	for ( NameVect::Iter inst = rootName->childVect; inst.lte(); inst++ )
 		(*inst)->numRefs += 1;
@@ -1361,6 +1580,12 @@ FsmRes ParseData::makeAll()
 	}
 
 	delete[] graphs;
+
+	if ( id->printStatistics ) {
+		id->stats() << "ref-cache-hits\t" << refCacheHits << endl;
+		id->stats() << "ref-cache-misses\t" << refCacheMisses << endl;
+	}
+
 	return FsmRes( FsmRes::Fsm(), mainGraph );
 }
 
@@ -1418,15 +1643,20 @@ FsmRes ParseData::prepareMachineGen( GraphDictEl *graphDictEl, const HostLang *h
 	makeRootNames();
 	initLongestMatchData();
 
-	/* Make the graph, do minimization. */
+	/* Make the graph, do minimization. The operator report is most useful
+	 * when the build fails, so it goes out either way. */
 	if ( graphDictEl == 0 ) {
 		FsmRes res = makeAll();
+		if ( id->opReport > 0 )
+			reportOps();
 		if ( !res.success() )
 			return res;
 		sectionGraph = res.fsm;
 	}
 	else {
 		FsmRes res = makeSpecific( graphDictEl );
+		if ( id->opReport > 0 )
+			reportOps();
 		if ( !res.success() )
 			return res;
 		sectionGraph = res.fsm;
@@ -1436,22 +1666,151 @@ FsmRes ParseData::prepareMachineGen( GraphDictEl *graphDictEl, const HostLang *h
 	if ( id->errorCount > 0 )
 		return FsmRes( FsmRes::InternalError() );
 
+	double start = id->timeReport ? id->phaseClock() : 0;
+
 	fsmCtx->analyzeGraph( sectionGraph );
 
+	if ( id->timeReport ) {
+		id->recordPhase( phaseTimes, "analyzeGraph", sectionName, "",
+				start, sectionGraph );
+		start = id->phaseClock();
+	}
+
 	/* Depends on the graph analysis. */
 	longestMatchInitTweaks( sectionGraph );
 
 	fsmCtx->prepareReduction( sectionGraph );
 
+	if ( id->timeReport ) {
+		id->recordPhase( phaseTimes, "prepareReduction", sectionName, "",
+				start, sectionGraph );
+	}
+
 	return FsmRes( FsmRes::Fsm(), sectionGraph );
 }
 
+/* Flat tables index each state's transitions by key, over the span from its
+ * lowest to its highest key. For wide alphabets that can run out of memory,
+ * so warn past this many entries. */
+static const unsigned long long flatIndexMax = 1ULL << 26;
+
+/*
+ * Sizes the flat index from the section graph before reduction, which only
+ * estimates what the flat generator builds. Under -F0 and -F1 an index over
+ * the limit gets a warning. With -s the alphabet's equivalence classes are
+ * also counted, by cutting the alphabet at the edges of every transition,
+ * and reported along with the index size a class mapped table would need.
+ */
+void ParseData::flatIndexCheck( CodeStyle codeStyle )
+{
+	bool flat = codeStyle == GenFlatLoop || codeStyle == GenFlatExp;
+	if ( !flat && !id->printStatistics )
+		return;
+
+	KeyOps *keyOps = fsmCtx->keyOps;
+
+	std::set<unsigned long long> cuts;
+	unsigned long long flatIndex = 0, maxSpan = 0;
+	long states = 0;
+	for ( StateList::Iter st = sectionGraph->stateList; st.lte(); st++ ) {
+		if ( st->outList.length() == 0 )
+			continue;
+
+		unsigned long long span = keyOps->span( st->outList.head->lowKey,
+				st->outList.tail->highKey );
+		flatIndex += span;
+		if ( span > maxSpan )
+			maxSpan = span;
+		states += 1;
+
+		if ( !id->printStatistics )
+			continue;
+
+		/* A cut at position n separates key offsets n - 1 and n. */
+		for ( TransList::Iter trans = st->outList; trans.lte(); trans++ ) {
+			if ( keyOps->lt( keyOps->minKey, trans->lowKey ) )
+				cuts.insert( keyOps->span( keyOps->minKey, trans->lowKey ) - 1 );
+			if ( keyOps->lt( trans->highKey, keyOps->maxKey ) )
+				cuts.insert( keyOps->span( keyOps->minKey, trans->highKey ) );
+		}
+	}
+
+	if ( id->printStatistics ) {
+		unsigned long long classes = cuts.size() + 1;
+		id->stats() << "alph-classes\t" << classes << endl;
+		id->stats() << "flat-span-max\t" << maxSpan << endl;
+		id->stats() << "flat-index\t" << flatIndex << endl;
+		id->stats() << "flat-class-index\t" << states * classes << endl;
+	}
+
+	if ( flat && flatIndex > flatIndexMax ) {
+		id->warning( sectionLoc ) << "machine " << sectionName << " may need " <<
+				flatIndex << " flat index entries for its alphabet, over " <<
+				flatIndexMax << ", consider a table or goto code style" << endl;
+	}
+}
+
+/* A state that loops on itself for all but this many bytes, without running
+ * any actions, could scan ahead to the next exit byte in bulk. */
+static const unsigned long long skipExitMax = 3;
+
+/*
+ * Reports the states that qualify for a skip loop, by the number of bytes
+ * that leave them, from one up. A state that loops on every byte never
+ * leaves, so there is nothing to scan for. Only byte alphabets are
+ * considered. A state with to-state or from-state actions must run them on
+ * every character, so it does not qualify, and neither does a self loop that
+ * carries actions.
+ */
+void ParseData::skipStateReport()
+{
+	KeyOps *keyOps = fsmCtx->keyOps;
+	unsigned long long alphSpan = keyOps->span( keyOps->minKey, keyOps->maxKey );
+	if ( alphSpan > 256 )
+		return;
+
+	long exits[skipExitMax + 1] = { 0 };
+	for ( StateList::Iter st = sectionGraph->stateList; st.lte(); st++ ) {
+		if ( st->toStateActionTable.length() > 0 ||
+				st->fromStateActionTable.length() > 0 )
+			continue;
+
+		unsigned long long selfSpan = 0;
+		for ( TransList::Iter trans = st->outList; trans.lte(); trans++ ) {
+			if ( trans->plain() && trans->tdap()->toState == st &&
+					trans->tdap()->actionTable.length() == 0 )
+			{
+				selfSpan += keyOps->span( trans->lowKey, trans->highKey );
+			}
+		}
+
+		if ( selfSpan > 0 && selfSpan < alphSpan &&
+				alphSpan - selfSpan <= skipExitMax )
+			exits[alphSpan - selfSpan] += 1;
+	}
+
+	for ( unsigned long long e = 1; e <= skipExitMax; e++ )
+		id->stats() << "skip-states-exit" << e << "\t" << exits[e] << endl;
+}
+
 void ParseData::generateReduced( const char *inputFileName, CodeStyle codeStyle,
 		std::ostream &out, const HostLang *hostLang )
 {
+	flatIndexCheck( codeStyle );
+
+	if ( id->printStatistics )
+		skipStateReport();
+
+	double start = id->timeReport ? id->phaseClock() : 0;
+
 	Reducer *red = new Reducer( this->id, fsmCtx, sectionGraph, sectionName, machineId );
 	red->make();
 
+	if ( id->timeReport ) {
+		id->recordPhase( phaseTimes, "Reducer::make", sectionName, "",
+				start, sectionGraph );
+	}
+
 	CodeGenArgs args( this->id, red, alphType, machineId, inputFileName, sectionName, out, codeStyle, hostLang->genLineDirective, hostLang->backend );
 
 	args.lineDirectives = !id->noLineDirectives;
@@ -1461,8 +1820,20 @@ void ParseData::generateReduced( const char *inputFileName, CodeStyle codeStyle,
 	/* Write out with it. */
 	cgd = (*hostLang->makeCodeGen)( hostLang, args );
 
+	start = id->timeReport ? id->phaseClock() : 0;
+
 	/* Code generation anlysis step. */
 	cgd->genAnalysis();
+
+	if ( id->timeReport )
+		id->recordPhase( phaseTimes, "genAnalysis", sectionName, "", start, 0 );
+}
+
+void ParseData::clearRefCache()
+{
+	for ( RefCache::Iter rc = refCache; rc.lte(); rc++ )
+		delete rc->value;
+	refCache.empty();
 }
 
 #if 0
@@ -1478,12 +1849,19 @@ void ParseData::generateXML( ostream &out )
 
 void ParseData::clear()
 {
-	cgd->clear();
+	/* Not made if the section had no instances or came from the cache. */
+	if ( cgd != 0 )
+		cgd->clear();
 
 	delete sectionGraph;
 	sectionGraph = 0;
 
+	clearRefCache();
+
+	/* The instance list shares its elements with the graph dict. */
+	instanceList.abandon();
 	graphDict.empty();
+	shadowedBuiltins.empty();
 
 	/* Delete all the nodes in the action list. Will cause all the
 	 * string data that represents the actions to be deallocated. */
@@ -64,6 +64,7 @@ struct LongestMatch;
 struct CodeGenData;
 struct InputData;
 struct InputItem;
+struct SectionCache;
 
 typedef DList<LongestMatch> LmList;
 
@@ -86,9 +87,9 @@ struct GraphDictEl
 	public DListEl<GraphDictEl>
 {
 	GraphDictEl( std::string k ) 
-		: key(k), value(0), isInstance(false) { }
+		: key(k), value(0), isInstance(false), isWeak(false) { }
 	GraphDictEl( std::string k, VarDef *value ) 
-		: key(k), value(value), isInstance(false) { }
+		: key(k), value(value), isInstance(false), isWeak(false) { }
 	
 	~GraphDictEl()
 	{
@@ -101,6 +102,9 @@ struct GraphDictEl
 	VarDef *value;
 	bool isInstance;
 
+	/* A builtin that a definition of the same name replaces. */
+	bool isWeak;
+
 	/* Location info of graph definition. Points to variable name of assignment. */
 	InputLoc loc;
 };
@@ -117,6 +121,10 @@ typedef AvlMapEl<std::string, int> LocalErrDictEl;
 typedef AvlMap<std::string, int, CmpString> LocalErrDict;
 
 /* Tree of instantiated names. */
+/* Graphs of definitions that can be reused by later references. */
+typedef AvlMapEl<VarDef*, FsmAp*> RefCacheEl;
+typedef AvlMap<VarDef*, FsmAp*, CmpOrd<VarDef*> > RefCache;
+
 typedef AvlMapEl<std::string, NameMapVal*> NameMapEl;
 typedef AvlMap<std::string, NameMapVal*, CmpString> NameMap;
 typedef Vector<NameInst*> NameVect;
@@ -130,6 +138,35 @@ struct NameFrame
 	NameInst *prevLocalScope;
 };
 
+/* Size of the graph an operator produced and the time it took, for the
+ * operator report. The states are -1 if the operator failed. Time does not
+ * include nested operators. */
+struct OpStat
+{
+	OpStat( const InputLoc &loc, const std::string &op, const std::string &def,
+			long states, long trans, double ms )
+		: loc(loc), op(op), def(def), states(states), trans(trans), ms(ms) {}
+
+	InputLoc loc;
+	std::string op;
+	std::string def;
+	long states;
+	long trans;
+	double ms;
+};
+
+typedef std::vector<OpStat> OpStatVect;
+
+/* Stack frame used in timing operators. */
+struct OpFrame
+{
+	double start;
+	long startKb;
+	double prevChildMs;
+	VarDef *prevDef;
+	const InputLoc *prevLoc;
+};
+
 struct LengthDef
 {
 	LengthDef( char *name )
@@ -164,7 +201,8 @@ struct ParseData
 
 	/* Initialize a graph dict with the basic fsms. */
 	void initGraphDict();
-	void createBuiltin( const char *name, BuiltinMachine builtin );
+	void createBuiltin( const char *name, BuiltinMachine builtin, bool weak = false );
+	bool shadowBuiltin( const std::string &name );
 
 	/* Make a name id in the current name instantiation scope if it is not
 	 * already there. */
@@ -214,6 +252,8 @@ struct ParseData
 
 	FsmRes prepareMachineGen( GraphDictEl *graphDictEl, const HostLang *hostLang );
 	void generateXML( ostream &out );
+	void flatIndexCheck( CodeStyle codeStyle );
+	void skipStateReport();
 	void generateReduced( const char *inputFileName, CodeStyle codeStyle,
 			std::ostream &out, const HostLang *hostLang );
 
@@ -234,6 +274,10 @@ struct ParseData
 	/* The list of instances. */
 	GraphList instanceList;
 
+	/* Weak builtins replaced by a definition. Kept for the references made
+	 * before the definition. */
+	GraphList shadowedBuiltins;
+
 	/* Dictionary of actions. Lets actions be defined and then referenced. */
 	ActionDict actionDict;
 
@@ -297,6 +341,11 @@ struct ParseData
 	void popNameScope( const NameFrame &frame );
 	void resetNameScope( const NameFrame &frame );
 
+	bool trackOps() { return id->opReport > 0 || id->memoryLimit > 0; }
+	OpFrame enterOp( VarDef *def, const InputLoc &loc );
+	void leaveOp( const OpFrame &frame, const std::string &op, FsmRes &res );
+	void reportOps();
+
 	void nfaTermCheckKleeneZero();
 	void nfaTermCheckMinZero();
 	void nfaTermCheckPlusZero();
@@ -304,6 +353,7 @@ struct ParseData
 	void nfaTermCheckZeroReps();
 
 	void clear();
+	void clearRefCache();
 
 	/* Counter for assigning ids to longest match items. */
 	int nextLongestMatchId;
@@ -331,6 +381,41 @@ struct ParseData
 
 	CodeGenData *cgd;
 
+	/* Built graphs of definitions that do not depend on where they are
+	 * referenced. Copied out on each repeated reference, handed over on the
+	 * last. */
+	RefCache refCache;
+	long refCacheHits;
+	long refCacheMisses;
+
+	/* Set when the section was compiled ahead of its last reference, by a
+	 * --jobs child that failed. The result is consumed by checkLastRef. */
+	bool compiled;
+	bool compileSuccess;
+
+	/* Entry in the compilation cache, if it is enabled. */
+	SectionCache *cache;
+
+	/* Operator applications for --op-report. */
+	OpStatVect opStats;
+	double opChildMs;
+	VarDef *curOpDef;
+
+	/* The innermost operator being applied, and where --memory-limit was
+	 * exceeded, if it was. */
+	const InputLoc *curOpLoc;
+	bool memoryLimitHit;
+	InputLoc memoryLimitLoc;
+	long memoryLimitAddedKb;
+
+	/* Resident size at the last --memory-limit check, and the states built
+	 * by operators since then. */
+	long memoryCheckKb;
+	long memoryCheckStates;
+
+	/* Timings of this section's phases for --time-report. */
+	PhaseTimeVect phaseTimes;
+
 	struct Cut
 	{
 		Cut( std::string name, int entryId )
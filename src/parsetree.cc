@@ -26,6 +26,10 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <set>
+#include <map>
+#include <vector>
+#include <algorithm>
 #include "inputdata.h"
 
 /* Parsing. */
@@ -129,6 +133,17 @@ Key *prepareHexString( ParseData *pd, const InputLoc &loc,
 }
 
 FsmRes VarDef::walk( ParseData *pd )
+{
+	if ( !pd->trackOps() )
+		return walkDef( pd );
+
+	OpFrame opFrame = pd->enterOp( this, loc );
+	FsmRes rtnVal = walkDef( pd );
+	pd->leaveOp( opFrame, "def", rtnVal );
+	return rtnVal;
+}
+
+FsmRes VarDef::walkDef( ParseData *pd )
 {
 	/* We enter into a new name scope. */
 	NameFrame nameFrame = pd->enterNameScope( true, 1 );
@@ -169,6 +184,93 @@ FsmRes VarDef::walk( ParseData *pd )
 	return rtnVal;
 }
 
+/* True if anything refers to the name or to a name below it. Such a graph
+ * needs entry points that are specific to where it is instantiated. */
+static bool anyNameRefs( NameInst *nameInst )
+{
+	if ( nameInst->numRefs > 0 || nameInst->referencedNames.length() > 0 )
+		return true;
+
+	for ( NameVect::Iter ch = nameInst->childVect; ch.lte(); ch++ ) {
+		if ( anyNameRefs( *ch ) )
+			return true;
+	}
+
+	return false;
+}
+
+/* Take the built graph of a definition for a repeated reference. The last
+ * reference gets the cached graph itself, the others a copy. */
+FsmRes VarDef::walkCached( ParseData *pd, FsmAp *cached )
+{
+	/* Keep the name tree walk in step. */
+	NameFrame nameFrame = pd->enterNameScope( true, 1 );
+
+	FsmAp *fsm = 0;
+	if ( numRefWalks == numFactorRefs ) {
+		fsm = cached;
+		pd->refCache.remove( this );
+	}
+	else {
+		fsm = new FsmAp( *cached );
+	}
+
+	pd->popNameScope( nameFrame );
+	return FsmRes( FsmRes::Fsm(), fsm );
+}
+
+/* Walk a reference to a definition. If building the definition consumed no
+ * ordering numbers, priority keys, epsilon links or cuts, and left no entry
+ * points, then it comes out the same every time and later references can
+ * take a copy of the first build. */
+FsmRes VarDef::walkRef( ParseData *pd )
+{
+	numRefWalks += 1;
+
+	/* A single reference has nothing to share. The name instantiation the
+	 * walk is about to enter must also be free of references. */
+	if ( numFactorRefs < 2 || anyNameRefs( pd->nextNameScope() ) )
+		return walk( pd );
+
+	RefCacheEl *cached = pd->refCache.find( this );
+	if ( cached != 0 ) {
+		pd->refCacheHits += 1;
+
+		if ( !pd->trackOps() )
+			return walkCached( pd, cached->value );
+
+		OpFrame opFrame = pd->enterOp( this, loc );
+		FsmRes rtnVal = walkCached( pd, cached->value );
+		pd->leaveOp( opFrame, "copy", rtnVal );
+		return rtnVal;
+	}
+
+	pd->refCacheMisses += 1;
+
+	int curActionOrd = pd->fsmCtx->curActionOrd;
+	int curPriorOrd = pd->fsmCtx->curPriorOrd;
+	int nextPriorKey = pd->fsmCtx->nextPriorKey;
+	int nextEpsilonResolvedLink = pd->nextEpsilonResolvedLink;
+	long numCuts = pd->cuts.length();
+
+	FsmRes rtnVal = walk( pd );
+	if ( !rtnVal.success() )
+		return rtnVal;
+
+	if ( curActionOrd == pd->fsmCtx->curActionOrd &&
+			curPriorOrd == pd->fsmCtx->curPriorOrd &&
+			nextPriorKey == pd->fsmCtx->nextPriorKey &&
+			nextEpsilonResolvedLink == pd->nextEpsilonResolvedLink &&
+			numCuts == pd->cuts.length() &&
+			rtnVal.fsm->entryPoints.length() == 0 &&
+			numRefWalks < numFactorRefs )
+	{
+		pd->refCache.insert( this, new FsmAp( *rtnVal.fsm ) );
+	}
+
+	return rtnVal;
+}
+
 void VarDef::makeNameTree( const InputLoc &loc, ParseData *pd )
 {
 	/* The variable definition enters a new scope. */
@@ -730,27 +832,179 @@ Expression::~Expression()
 }
 
 /* Evaluate a single expression node. */
-FsmRes Expression::walk( ParseData *pd, bool lastInSeq )
+const char *Expression::opName()
 {
 	switch ( type ) {
-		case OrType: {
-			/* Evaluate the expression. */
-			FsmRes exprFsm = expression->walk( pd, false );
-			if ( !exprFsm.success() )
-				return exprFsm;
+		case OrType: return "|";
+		case IntersectType: return "&";
+		case SubtractType: return "-";
+		case StrongSubtractType: return "--";
+		case TermType: case BuiltinType: break;
+	}
+	return "";
+}
 
-			/* Evaluate the term. */
-			FsmRes rhs = term->walk( pd );
-			if ( !rhs.success() )
-				return rhs;
+FsmRes Expression::walk( ParseData *pd, bool lastInSeq )
+{
+	if ( !pd->trackOps() || type == TermType || type == BuiltinType )
+		return walkOp( pd, lastInSeq );
 
-			/* Perform union. */
-			FsmRes res = FsmAp::unionOp( exprFsm.fsm, rhs.fsm, lastInSeq );
-			if ( !res.success() )
+	OpFrame opFrame = pd->enterOp( 0, loc );
+	FsmRes res = walkOp( pd, lastInSeq );
+	pd->leaveOp( opFrame, opName(), res );
+	return res;
+}
+
+/* Shortest union of plain literals that is built as a keyword set. */
+static const size_t keywordSetMin = 8;
+
+/* Collect the literals of a union chain made only of plain literals. */
+bool Expression::literalUnion( std::vector<Literal*> &literals )
+{
+	Expression *expr = this;
+	while ( expr->type == OrType ) {
+		Literal *literal = expr->term->plainLiteral();
+		if ( literal == 0 )
+			return false;
+
+		literals.push_back( literal );
+		expr = expr->expression;
+	}
+
+	if ( expr->type != TermType )
+		return false;
+
+	Literal *literal = expr->term->plainLiteral();
+	if ( literal == 0 )
+		return false;
+
+	literals.push_back( literal );
+	return true;
+}
+
+/* An operand of a balanced union, with the number of merges it took. */
+struct UnionOperand
+{
+	UnionOperand( FsmAp *fsm, int rank )
+		: fsm(fsm), rank(rank) {}
+
+	FsmAp *fsm;
+	int rank;
+};
+
+static void deleteOperands( std::vector<UnionOperand> &operands )
+{
+	for ( size_t i = 0; i < operands.size(); i++ )
+		delete operands[i].fsm;
+	operands.clear();
+}
+
+/* One merge of a union chain, tracked as an operator of the given | node.
+ * The merge done last belongs to the head of the chain, which walk() already
+ * tracks, so it is passed no node. */
+static FsmRes unionMerge( ParseData *pd, Expression *node,
+		FsmAp *l, FsmAp *r, bool lastInSeq )
+{
+	if ( node == 0 || !pd->trackOps() )
+		return FsmAp::unionOp( l, r, lastInSeq );
+
+	OpFrame opFrame = pd->enterOp( 0, node->loc );
+	FsmRes res = FsmAp::unionOp( l, r, lastInSeq );
+	pd->leaveOp( opFrame, node->opName(), res );
+	return res;
+}
+
+/*
+ * Union a left-deep chain of unions. The operands are walked left to right,
+ * keeping the action and priority orderings of the chain, but they are merged
+ * pairwise as on a binary counter, so operands of equal size are unioned
+ * together. Unioning into an ever-growing left operand instead copies and
+ * determinizes that operand once for every alternative. Only the final union
+ * gets lastInSeq. There is one merge for each | in the chain, and each is
+ * tracked against one of them, innermost first.
+ */
+FsmRes Expression::walkUnion( ParseData *pd, bool lastInSeq )
+{
+	std::vector<Expression*> ors;
+	std::vector<Term*> terms;
+	Expression *first = this;
+	while ( first->type == OrType ) {
+		ors.push_back( first );
+		terms.push_back( first->term );
+		first = first->expression;
+	}
+
+	long nextOr = ors.size() - 1;
+	std::vector<UnionOperand> operands;
+
+	FsmRes firstFsm = first->walk( pd, false );
+	if ( !firstFsm.success() )
+		return firstFsm;
+	operands.push_back( UnionOperand( firstFsm.fsm, 0 ) );
+
+	for ( long t = terms.size() - 1; t >= 0; t-- ) {
+		FsmRes rhs = terms[t]->walk( pd );
+		if ( !rhs.success() ) {
+			deleteOperands( operands );
+			return rhs;
+		}
+		operands.push_back( UnionOperand( rhs.fsm, 0 ) );
+
+		while ( operands.size() >= 2 &&
+				operands[operands.size() - 1].rank == operands[operands.size() - 2].rank )
+		{
+			UnionOperand r = operands.back();
+			operands.pop_back();
+			UnionOperand l = operands.back();
+			operands.pop_back();
+
+			bool last = t == 0 && operands.size() == 0;
+			Expression *node = nextOr > 0 ? ors[nextOr] : 0;
+			nextOr -= 1;
+
+			FsmRes res = unionMerge( pd, node, l.fsm, r.fsm, last && lastInSeq );
+			if ( !res.success() ) {
+				deleteOperands( operands );
 				return res;
+			}
+			operands.push_back( UnionOperand( res.fsm, l.rank + 1 ) );
+		}
+	}
 
+	/* Fold what is left, smallest first. */
+	while ( operands.size() >= 2 ) {
+		UnionOperand r = operands.back();
+		operands.pop_back();
+		UnionOperand l = operands.back();
+		operands.pop_back();
+
+		Expression *node = nextOr > 0 ? ors[nextOr] : 0;
+		nextOr -= 1;
+
+		FsmRes res = unionMerge( pd, node, l.fsm, r.fsm,
+				operands.size() == 0 && lastInSeq );
+		if ( !res.success() ) {
+			deleteOperands( operands );
 			return res;
 		}
+		operands.push_back( UnionOperand( res.fsm, l.rank + 1 ) );
+	}
+
+	return FsmRes( FsmRes::Fsm(), operands[0].fsm );
+}
+
+FsmRes Expression::walkOp( ParseData *pd, bool lastInSeq )
+{
+	switch ( type ) {
+		case OrType: {
+			/* The whole union chain is walked from its head. If it is all
+			 * plain literals, build it directly as a keyword set. */
+			std::vector<Literal*> literals;
+			if ( literalUnion( literals ) && literals.size() >= keywordSetMin )
+				return FsmRes( FsmRes::Fsm(), keywordSetFsm( pd, literals ) );
+
+			return walkUnion( pd, lastInSeq );
+		}
 		case IntersectType: {
 			/* Evaluate the expression. */
 			FsmRes exprFsm = expression->walk( pd );
@@ -874,8 +1128,67 @@ Term::~Term()
 		delete factorWithAug;
 }
 
-/* Evaluate a term node. */
+const char *Term::opName()
+{
+	switch ( type ) {
+		case ConcatType: return ".";
+		case RightStartType: return ":>";
+		case RightFinishType: return ":>>";
+		case LeftType: return "<:";
+		case FactorWithAugType: break;
+	}
+	return "";
+}
+
 FsmRes Term::walk( ParseData *pd, bool lastInSeq )
+{
+	if ( !pd->trackOps() || type == FactorWithAugType )
+		return walkOp( pd, lastInSeq );
+
+	OpFrame opFrame = pd->enterOp( 0, loc );
+	FsmRes res = walkOp( pd, lastInSeq );
+	pd->leaveOp( opFrame, opName(), res );
+	return res;
+}
+
+/* Evaluate a term node. */
+/* The literal, if this term is nothing more than a plain literal: no
+ * operators, augmentations, labels or repetition, and no literal options. */
+Literal *Term::plainLiteral()
+{
+	if ( type != FactorWithAugType )
+		return 0;
+
+	FactorWithAug *fwa = factorWithAug;
+	if ( fwa->actions.length() > 0 || fwa->priorityAugs.length() > 0 ||
+			fwa->labels.size() > 0 || fwa->epsilonLinks.length() > 0 ||
+			fwa->conditions.length() > 0 )
+		return 0;
+
+	FactorWithRep *fwr = fwa->factorWithRep;
+	if ( fwr->type != FactorWithRep::FactorWithNegType )
+		return 0;
+
+	FactorWithNeg *fwn = fwr->factorWithNeg;
+	if ( fwn->type != FactorWithNeg::FactorType )
+		return 0;
+
+	Factor *factor = fwn->factor;
+	if ( factor->type != Factor::LiteralType )
+		return 0;
+
+	Literal *literal = factor->literal;
+	if ( literal->type == Literal::LitString ) {
+		/* Case-insensitive strings are not a single key sequence. */
+		char last = literal->data[literal->data.length() - 1];
+		if ( last != '\'' && last != '"' )
+			return 0;
+	}
+
+	return literal;
+}
+
+FsmRes Term::walkOp( ParseData *pd, bool lastInSeq )
 {
 	switch ( type ) {
 		case ConcatType: {
@@ -1438,7 +1751,35 @@ FactorWithRep::~FactorWithRep()
 
 
 /* Evaluate a factor with repetition node. */
+std::string FactorWithRep::opName()
+{
+	std::ostringstream op;
+	switch ( type ) {
+		case StarType: op << "*"; break;
+		case StarStarType: op << "**"; break;
+		case OptionalType: op << "?"; break;
+		case PlusType: op << "+"; break;
+		case ExactType: op << "{" << lowerRep << "}"; break;
+		case MaxType: op << "{," << upperRep << "}"; break;
+		case MinType: op << "{" << lowerRep << ",}"; break;
+		case RangeType: op << "{" << lowerRep << "," << upperRep << "}"; break;
+		case FactorWithNegType: break;
+	}
+	return op.str();
+}
+
 FsmRes FactorWithRep::walk( ParseData *pd )
+{
+	if ( !pd->trackOps() || type == FactorWithNegType )
+		return walkOp( pd );
+
+	OpFrame opFrame = pd->enterOp( 0, loc );
+	FsmRes res = walkOp( pd );
+	pd->leaveOp( opFrame, opName(), res );
+	return res;
+}
+
+FsmRes FactorWithRep::walkOp( ParseData *pd )
 {
 	switch ( type ) {
 	case StarType: {
@@ -1754,7 +2095,7 @@ FsmRes Factor::walk( ParseData *pd )
 	case RegExprType:
 		return FsmRes( FsmRes::Fsm(), regExpr->walk( pd, 0 ) );
 	case ReferenceType:
-		return varDef->walk( pd );
+		return varDef->walkRef( pd );
 	case ParenType:
 		return join->walk( pd );
 	case LongestMatchType:
@@ -1838,6 +2179,7 @@ void Factor::makeNameTree( ParseData *pd )
 	case RegExprType:
 		break;
 	case ReferenceType:
+		varDef->numFactorRefs += 1;
 		varDef->makeNameTree( loc, pd );
 		break;
 	case ParenType:
@@ -1977,6 +2319,375 @@ FsmAp *Literal::walk( ParseData *pd )
 	return rtnVal;
 }
 
+/* The key sequence of a literal. Literal strings must not carry options. */
+void Literal::makeKeys( ParseData *pd, std::vector<Key> &keys )
+{
+	switch ( type ) {
+	case Number: {
+		Vector<char> num = data;
+		if ( neg )
+			num.insert( 0, '-' );
+		num.append( 0 );
+
+		keys.push_back( makeFsmKeyNum( num.data, loc, pd ) );
+		break;
+	}
+	case LitString: {
+		long length;
+		bool caseInsensitive;
+		char *litstr = prepareLitString( pd->id, loc, data.data, data.length(), 
+				length, caseInsensitive );
+		Key *arr = new Key[length];
+		makeFsmKeyArray( arr, litstr, length, pd );
+
+		keys.insert( keys.end(), arr, arr + length );
+		delete[] litstr;
+		delete[] arr;
+		break;
+	}
+	case HexString: {
+		long length;
+		Key *arr = prepareHexString( pd, loc, data.data, data.length(), length );
+		keys.insert( keys.end(), arr, arr + length );
+		delete[] arr;
+		break;
+	}}
+}
+
+/*
+ * Keyword sets. A union of plain literals is built straight into a minimal
+ * acyclic DFA, in one pass over the sorted keys: each key shares the prefix
+ * it has in common with the one before it, and once the previous key's
+ * suffix is complete its states are merged with equivalent ones already
+ * built. This replaces making a machine for every literal and then a union
+ * operation for each one.
+ *
+ * The builder works on sequences of key ranges, so it also makes the UTF-8
+ * classes. It relies on two ranges at the same position of sequences with
+ * equal prefixes being either equal or disjoint, which holds for keys and
+ * for the UTF-8 splits below.
+ */
+
+struct KwRange
+{
+	KwRange( Key lo, Key hi ) : lo(lo), hi(hi) {}
+
+	Key lo;
+	Key hi;
+};
+
+typedef std::vector<KwRange> KwKeys;
+
+/* Orders ranges by low key, then high key. Zero if equal. */
+static int kwCmpRange( KeyOps *keyOps, const KwRange &r1, const KwRange &r2 )
+{
+	if ( keyOps->lt( r1.lo, r2.lo ) )
+		return -1;
+	if ( keyOps->lt( r2.lo, r1.lo ) )
+		return 1;
+	if ( keyOps->lt( r1.hi, r2.hi ) )
+		return -1;
+	if ( keyOps->lt( r2.hi, r1.hi ) )
+		return 1;
+	return 0;
+}
+
+struct KwCmpKeys
+{
+	KwCmpKeys( KeyOps *keyOps ) : keyOps(keyOps) {}
+
+	bool operator()( const KwKeys *k1, const KwKeys *k2 ) const
+	{
+		size_t n = k1->size() < k2->size() ? k1->size() : k2->size();
+		for ( size_t i = 0; i < n; i++ ) {
+			int c = kwCmpRange( keyOps, (*k1)[i], (*k2)[i] );
+			if ( c != 0 )
+				return c < 0;
+		}
+		return k1->size() < k2->size();
+	}
+
+	KeyOps *keyOps;
+};
+
+struct KwNode
+{
+	KwNode() : final(false), state(0) {}
+
+	bool final;
+
+	/* Out transitions in key order, to node indices. */
+	std::vector< std::pair<KwRange, int> > out;
+
+	StateAp *state;
+};
+
+typedef std::vector<KwNode> KwNodeVect;
+
+/* Orders nodes by finality and out transitions, so equivalent nodes compare
+ * equal. */
+struct KwCmpNode
+{
+	KwCmpNode( KeyOps *keyOps, const KwNodeVect *nodes )
+		: keyOps(keyOps), nodes(nodes) {}
+
+	bool operator()( int n1, int n2 ) const
+	{
+		const KwNode &a = (*nodes)[n1];
+		const KwNode &b = (*nodes)[n2];
+		if ( a.final != b.final )
+			return b.final;
+		if ( a.out.size() != b.out.size() )
+			return a.out.size() < b.out.size();
+		for ( size_t i = 0; i < a.out.size(); i++ ) {
+			int c = kwCmpRange( keyOps, a.out[i].first, b.out[i].first );
+			if ( c != 0 )
+				return c < 0;
+			if ( a.out[i].second != b.out[i].second )
+				return a.out[i].second < b.out[i].second;
+		}
+		return false;
+	}
+
+	KeyOps *keyOps;
+	const KwNodeVect *nodes;
+};
+
+typedef std::set<int, KwCmpNode> KwRegister;
+
+/* Replace the last child of a node, and the nodes below it, with equivalent
+ * nodes that are already registered. Registers the ones that have none. */
+static void kwReplaceOrRegister( KwNodeVect &nodes, KwRegister &reg, int n )
+{
+	int child = nodes[n].out.back().second;
+	if ( nodes[child].out.size() > 0 )
+		kwReplaceOrRegister( nodes, reg, child );
+
+	KwRegister::iterator r = reg.find( child );
+	if ( r != reg.end() )
+		nodes[n].out.back().second = *r;
+	else
+		reg.insert( child );
+}
+
+static FsmAp *kwSetFsm( ParseData *pd, const std::vector<KwKeys> &keys )
+{
+	KeyOps *keyOps = pd->fsmCtx->keyOps;
+
+	std::vector<const KwKeys*> sorted;
+	for ( size_t i = 0; i < keys.size(); i++ )
+		sorted.push_back( &keys[i] );
+
+	std::sort( sorted.begin(), sorted.end(), KwCmpKeys( keyOps ) );
+
+	/* Node zero is the root. */
+	KwNodeVect nodes( 1 );
+	KwRegister reg( KwCmpNode( keyOps, &nodes ) );
+
+	const KwKeys *prev = 0;
+	for ( size_t w = 0; w < sorted.size(); w++ ) {
+		const KwKeys &cur = *sorted[w];
+
+		size_t common = 0;
+		if ( prev != 0 ) {
+			while ( common < prev->size() && common < cur.size() &&
+					kwCmpRange( keyOps, (*prev)[common], cur[common] ) == 0 )
+				common += 1;
+
+			/* Duplicate. */
+			if ( common == prev->size() && common == cur.size() )
+				continue;
+		}
+
+		/* The common prefix follows the previous key's path, which is always
+		 * the last child. */
+		int n = 0;
+		for ( size_t i = 0; i < common; i++ )
+			n = nodes[n].out.back().second;
+
+		/* The previous key's suffix beyond here is complete. */
+		if ( nodes[n].out.size() > 0 )
+			kwReplaceOrRegister( nodes, reg, n );
+
+		for ( size_t i = common; i < cur.size(); i++ ) {
+			nodes.push_back( KwNode() );
+			int next = nodes.size() - 1;
+			nodes[n].out.push_back( std::make_pair( cur[i], next ) );
+			n = next;
+		}
+
+		nodes[n].final = true;
+		prev = &cur;
+	}
+
+	if ( nodes[0].out.size() > 0 )
+		kwReplaceOrRegister( nodes, reg, 0 );
+
+	/* Make the states reachable from the root. Replaced nodes are left
+	 * behind. */
+	FsmAp *fsm = new FsmAp( pd->fsmCtx );
+	nodes[0].state = fsm->addState();
+	fsm->setStartState( nodes[0].state );
+
+	std::vector<int> stack;
+	stack.push_back( 0 );
+	while ( stack.size() > 0 ) {
+		int n = stack.back();
+		stack.pop_back();
+
+		for ( size_t i = 0; i < nodes[n].out.size(); i++ ) {
+			int to = nodes[n].out[i].second;
+			if ( nodes[to].state == 0 ) {
+				nodes[to].state = fsm->addState();
+				stack.push_back( to );
+			}
+
+			fsm->attachNewTrans( nodes[n].state, nodes[to].state,
+					nodes[n].out[i].first.lo, nodes[n].out[i].first.hi );
+		}
+
+		if ( nodes[n].final )
+			fsm->setFinState( nodes[n].state );
+	}
+
+	return fsm;
+}
+
+FsmAp *keywordSetFsm( ParseData *pd, const std::vector<Literal*> &literals )
+{
+	std::vector<KwKeys> keys( literals.size() );
+	for ( size_t i = 0; i < literals.size(); i++ ) {
+		std::vector<Key> lit;
+		literals[i]->makeKeys( pd, lit );
+		for ( size_t k = 0; k < lit.size(); k++ )
+			keys[i].push_back( KwRange( lit[k], lit[k] ) );
+	}
+
+	return kwSetFsm( pd, keys );
+}
+
+/*
+ * UTF-8 classes. A code point range is split into ranges that each encode as
+ * one sequence of byte ranges: split at the encoded length boundaries, then
+ * wherever the range does not cover whole blocks of continuation bytes.
+ * Surrogates have no encoding and are left out.
+ */
+
+struct Utf8Seq
+{
+	int length;
+	unsigned char lo[4];
+	unsigned char hi[4];
+};
+
+typedef std::vector<Utf8Seq> Utf8SeqVect;
+
+static int utf8Encode( unsigned char *b, unsigned long c )
+{
+	if ( c <= 0x7f ) {
+		b[0] = c;
+		return 1;
+	}
+	if ( c <= 0x7ff ) {
+		b[0] = 0xc0 | ( c >> 6 );
+		b[1] = 0x80 | ( c & 0x3f );
+		return 2;
+	}
+	if ( c <= 0xffff ) {
+		b[0] = 0xe0 | ( c >> 12 );
+		b[1] = 0x80 | ( ( c >> 6 ) & 0x3f );
+		b[2] = 0x80 | ( c & 0x3f );
+		return 3;
+	}
+	b[0] = 0xf0 | ( c >> 18 );
+	b[1] = 0x80 | ( ( c >> 12 ) & 0x3f );
+	b[2] = 0x80 | ( ( c >> 6 ) & 0x3f );
+	b[3] = 0x80 | ( c & 0x3f );
+	return 4;
+}
+
+static void utf8Split( Utf8SeqVect &seqs, unsigned long low, unsigned long high )
+{
+	if ( low > high )
+		return;
+
+	/* Surrogates. */
+	if ( low <= 0xdfff && high >= 0xd800 ) {
+		if ( low < 0xd800 )
+			utf8Split( seqs, low, 0xd7ff );
+		if ( high > 0xdfff )
+			utf8Split( seqs, 0xe000, high );
+		return;
+	}
+
+	/* Encoded length boundaries. */
+	static const unsigned long lengthMax[] = { 0x7f, 0x7ff, 0xffff };
+	for ( int i = 0; i < 3; i++ ) {
+		if ( low <= lengthMax[i] && high > lengthMax[i] ) {
+			utf8Split( seqs, low, lengthMax[i] );
+			utf8Split( seqs, lengthMax[i] + 1, high );
+			return;
+		}
+	}
+
+	/* Continuation byte blocks, from the last byte up. */
+	for ( int i = 1; i < 4; i++ ) {
+		unsigned long m = ( 1UL << ( 6 * i ) ) - 1;
+		if ( ( low & ~m ) != ( high & ~m ) ) {
+			if ( ( low & m ) != 0 ) {
+				utf8Split( seqs, low, low | m );
+				utf8Split( seqs, ( low | m ) + 1, high );
+				return;
+			}
+			if ( ( high & m ) != m ) {
+				utf8Split( seqs, low, ( high & ~m ) - 1 );
+				utf8Split( seqs, high & ~m, high );
+				return;
+			}
+		}
+	}
+
+	Utf8Seq seq;
+	seq.length = utf8Encode( seq.lo, low );
+	utf8Encode( seq.hi, high );
+	seqs.push_back( seq );
+}
+
+/* The byte sequences of a class. Computed the first time the class is used
+ * and shared by every section after that. */
+static const Utf8SeqVect &utf8Sequences( const UnicodeRange *ranges, long length )
+{
+	static std::map<const UnicodeRange*, Utf8SeqVect> cache;
+
+	std::map<const UnicodeRange*, Utf8SeqVect>::iterator c = cache.find( ranges );
+	if ( c == cache.end() ) {
+		c = cache.insert( std::make_pair( ranges, Utf8SeqVect() ) ).first;
+		for ( long r = 0; r < length; r++ )
+			utf8Split( c->second, ranges[r].low, ranges[r].high );
+	}
+
+	/* Entries are never removed, so the reference stays good. */
+	return c->second;
+}
+
+/* The minimal DFA matching the UTF-8 encoding of any one code point in the
+ * ranges. */
+FsmAp *utf8ClassFsm( ParseData *pd, const UnicodeRange *ranges, long length )
+{
+	const Utf8SeqVect &seqs = utf8Sequences( ranges, length );
+
+	std::vector<KwKeys> keys( seqs.size() );
+	for ( size_t s = 0; s < seqs.size(); s++ ) {
+		for ( int i = 0; i < seqs[s].length; i++ ) {
+			keys[s].push_back( KwRange(
+					makeFsmKeyChar( (char)seqs[s].lo[i], pd ),
+					makeFsmKeyChar( (char)seqs[s].hi[i], pd ) ) );
+		}
+	}
+
+	return kwSetFsm( pd, keys );
+}
+
 /* Clean up after a regular expression object. */
 RegExpr::~RegExpr()
 {
@@ -49,10 +49,39 @@ enum BuiltinMachine
 	BT_Punct,
 	BT_Space,
 	BT_Xdigit,
+	BT_Utf8Any,
+	BT_Utf8Letter,
+	BT_Utf8Upper,
+	BT_Utf8Lower,
+	BT_Utf8Digit,
+	BT_Utf8Alnum,
+	BT_Utf8Space,
 	BT_Lambda,
 	BT_Empty
 };
 
+/* An inclusive range of Unicode code points. */
+struct UnicodeRange
+{
+	unsigned long low;
+	unsigned long high;
+};
+
+/* Code point classes behind the utf8_* builtins. Sorted, with adjacent ranges
+ * merged. Generated into unicode.cc by contrib/unicode2builtin.py. */
+extern const UnicodeRange unicodeLetter[];
+extern const long unicodeLetterLen;
+extern const UnicodeRange unicodeUpper[];
+extern const long unicodeUpperLen;
+extern const UnicodeRange unicodeLower[];
+extern const long unicodeLowerLen;
+extern const UnicodeRange unicodeDigit[];
+extern const long unicodeDigitLen;
+extern const UnicodeRange unicodeAlnum[];
+extern const long unicodeAlnumLen;
+extern const UnicodeRange unicodeSpace[];
+extern const long unicodeSpaceLen;
+
 
 struct ParseData;
 
@@ -241,18 +270,29 @@ struct PriorityAug
 struct VarDef
 {
 	VarDef( std::string name, MachineDef *machineDef )
-		: name(name), machineDef(machineDef), isExport(false) { }
+		: name(name), machineDef(machineDef), isExport(false),
+		numFactorRefs(0), numRefWalks(0) { }
 
 	~VarDef();
 
 	/* Parse tree traversal. */
 	FsmRes walk( ParseData *pd );
+	FsmRes walkDef( ParseData *pd );
+	FsmRes walkRef( ParseData *pd );
+	FsmRes walkCached( ParseData *pd, FsmAp *cached );
 	void makeNameTree( const InputLoc &loc, ParseData *pd );
 	void resolveNameRefs( ParseData *pd );
 
+	InputLoc loc;
 	std::string name;
 	MachineDef *machineDef;
 	bool isExport;
+
+	/* Factors that reference the definition, counted while making the name
+	 * tree, and the references walked so far. Only a definition referenced
+	 * more than once is worth keeping a built copy of. */
+	long numFactorRefs;
+	long numRefWalks;
 };
 
 
@@ -438,6 +478,10 @@ struct Expression
 		expression(expression), term(term), 
 		type(type), prev(this), next(this) { }
 
+	Expression( const InputLoc &loc, Expression *expression, Term *term, Type type ) : 
+		loc(loc), expression(expression), term(term), 
+		type(type), prev(this), next(this) { }
+
 	/* Construct with only a term. */
 	Expression( Term *term ) : 
 		expression(0), term(term),
@@ -452,10 +496,15 @@ struct Expression
 
 	/* Tree traversal. */
 	FsmRes walk( ParseData *pd, bool lastInSeq = true );
+	FsmRes walkOp( ParseData *pd, bool lastInSeq );
+	FsmRes walkUnion( ParseData *pd, bool lastInSeq );
 	void makeNameTree( ParseData *pd );
 	void resolveNameRefs( ParseData *pd );
+	const char *opName();
+	bool literalUnion( std::vector<Literal*> &literals );
 
 	/* Node data. */
+	InputLoc loc;
 	Expression *expression;
 	Term *term;
 	BuiltinMachine builtin;
@@ -505,6 +554,9 @@ struct Term
 	Term( Term *term, FactorWithAug *factorWithAug, Type type ) :
 		term(term), factorWithAug(factorWithAug), type(type) { }
 
+	Term( const InputLoc &loc, Term *term, FactorWithAug *factorWithAug, Type type ) :
+		loc(loc), term(term), factorWithAug(factorWithAug), type(type) { }
+
 	Term( Action *action1, Action *action2, Action *action3, 
 			Term *term, FactorWithAug *factorWithAug,
 			FactorWithAug *factorWithAug2, Type type )
@@ -520,9 +572,13 @@ struct Term
 	~Term();
 
 	FsmRes walk( ParseData *pd, bool lastInSeq = true );
+	FsmRes walkOp( ParseData *pd, bool lastInSeq );
 	void makeNameTree( ParseData *pd );
 	void resolveNameRefs( ParseData *pd );
+	const char *opName();
+	Literal *plainLiteral();
 
+	InputLoc loc;
 	Action *action1;
 	Action *action2;
 	Action *action3;
@@ -601,8 +657,10 @@ struct FactorWithRep
 
 	/* Tree traversal. */
 	FsmRes walk( ParseData *pd );
+	FsmRes walkOp( ParseData *pd );
 	void makeNameTree( ParseData *pd );
 	void resolveNameRefs( ParseData *pd );
+	std::string opName();
 
 	InputLoc loc;
 	long long repId;
@@ -764,6 +822,7 @@ struct Literal
 	}
 
 	FsmAp *walk( ParseData *pd );
+	void makeKeys( ParseData *pd, std::vector<Key> &keys );
 	
 	InputLoc loc;
 	bool neg;
@@ -771,6 +830,9 @@ struct Literal
 	LiteralType type;
 };
 
+FsmAp *keywordSetFsm( ParseData *pd, const std::vector<Literal*> &literals );
+FsmAp *utf8ClassFsm( ParseData *pd, const UnicodeRange *ranges, long length );
+
 /* Regular expression. */
 struct RegExpr
 {
@@ -50,9 +50,13 @@ void TopLevel::tryMachineDef( const InputLoc &loc, std::string name,
 		MachineDef *machineDef, bool isInstance )
 {
 	GraphDictEl *newEl = pd->graphDict.insert( name );
+	if ( newEl == 0 && pd->shadowBuiltin( name ) )
+		newEl = pd->graphDict.insert( name );
+
 	if ( newEl != 0 ) {
 		/* New element in the dict, all good. */
 		newEl->value = new VarDef( name, machineDef );
+		newEl->value->loc = loc;
 		newEl->isInstance = isInstance;
 		newEl->loc = loc;
 		newEl->value->isExport = exportContext[exportContext.length()-1];
@@ -0,0 +1,65 @@
+#!/bin/bash
+
+#
+# Compiles an input with several C machine sections under --jobs and checks
+# that the output is the same as a serial compile, and that the output of
+# every child was spliced in without compiling its section again. Each
+# section has actions, so the C host writes line directives that return to
+# the output file and depend on where the section's code lands.
+#
+
+ragel="@SUBJ_RAGEL_BIN@"
+
+wk=working/jobs
+rm -Rf $wk
+mkdir -p $wk
+
+gen()
+{
+	for m in 1 2 3 4; do
+		echo "/* Host code ahead of machine $m. */"
+		i=0
+		while [ $i -lt $((m * 3)) ]; do
+			echo "int host${m}_$i = $i;"
+			i=$((i + 1))
+		done
+		echo
+		echo "%%{"
+		echo "	machine m$m;"
+		echo "	action word { words += 1; }"
+		echo "	action num { nums += $m; }"
+		echo "	main := ( [a-z]+ %word | [0-9]+ %num | ' ' )*;"
+		echo "}%%"
+		echo
+		echo "%% write data;"
+		echo
+		echo "int exec$m( const char *p, const char *pe )"
+		echo "{"
+		echo "	int cs, words = 0, nums = 0;"
+		echo "	const char *eof = pe;"
+		echo "	%% write init;"
+		echo "	%% write exec;"
+		echo "	return cs >= m${m}_first_final ? words + nums : -1;"
+		echo "}"
+		echo
+	done
+}
+
+gen > $wk/jobs.rl
+
+$ragel -o $wk/serial.c $wk/jobs.rl || exit 1
+$ragel --jobs=4 -s -o $wk/jobs.c $wk/jobs.rl 2> $wk/stats || exit 1
+
+if ! cmp -s $wk/serial.c $wk/jobs.c; then
+	echo "jobstest: output under --jobs differs from a serial compile" >&2
+	diff -u $wk/serial.c $wk/jobs.c >&2
+	exit 1
+fi
+
+if ! grep -q '^job-fallbacks	0$' $wk/stats; then
+	echo "jobstest: sections were compiled again after their child" >&2
+	grep '^job-fallbacks' $wk/stats >&2
+	exit 1
+fi
+
+exit 0
@@ -0,0 +1,48 @@
+/*
+ * @LANG: indep
+ */
+%%{
+	machine kwset1;
+
+	# Long enough to be built as a keyword set. Has a duplicate and literals
+	# that are prefixes of others.
+	kw = 'get' | 'post' | 'put' | 'set' | 'head' | 'list' | 'name' |
+			'type' | 'get' | 'po' | 'postal' | 'value';
+
+	# A case-insensitive literal keeps the chain a regular union.
+	kwi = 'GET'i | 'post' | 'put' | 'set' | 'head' | 'list' | 'name' |
+			'type';
+
+	main := ( '1' kw | '2' kwi ) '\n';
+}%%
+
+##### INPUT #####
+"1get\n"
+"1po\n"
+"1pos\n"
+"1post\n"
+"1posta\n"
+"1postal\n"
+"1GET\n"
+"1value\n"
+"1\n"
+"2get\n"
+"2GeT\n"
+"2POST\n"
+"2type\n"
+"2types\n"
+##### OUTPUT #####
+ACCEPT
+ACCEPT
+FAIL
+ACCEPT
+FAIL
+ACCEPT
+FAIL
+ACCEPT
+FAIL
+ACCEPT
+ACCEPT
+FAIL
+ACCEPT
+FAIL
@@ -0,0 +1,37 @@
+/*
+ * @LANG: indep
+ * @NEEDS_EOF: yes
+ */
+
+ptr ts;
+ptr te;
+%%{
+	machine lmnfa2;
+
+	# Patterns that share prefixes, one that backs up over a partial match
+	# and one that always fails.
+	main := :nfa |*
+		"for"                    => { print_str "for\n"; };
+		"foreach" %when {false}  => { print_str "foreach --fail\n"; };
+		[a-z]+                   => { print_str "word\n"; };
+		[0-9]+                   => { print_str "num\n"; };
+		[0-9]+ '.' [0-9]+        => { print_str "float\n"; };
+		' '                      => { print_str "<space>\n"; };
+	*|;
+}%%
+
+##### INPUT #####
+"for foreach fort 12 1.5 x"
+##### OUTPUT #####
+for
+<space>
+word
+<space>
+word
+<space>
+num
+<space>
+float
+<space>
+word
+ACCEPT
@@ -0,0 +1,60 @@
+/*
+ * @LANG: indep
+ * @NEEDS_EOF: yes
+ */
+ptr ts;
+ptr te;
+int act;
+int token;
+
+%%{
+	machine scanner;
+
+	# Tokens that are prefixes of one another, and ones that need to back up
+	# over a partial match.
+	main := |*
+		'if' => {
+			print_str "if\n";
+		};
+		'int' => {
+			print_str "int\n";
+		};
+		'in' => {
+			print_str "in\n";
+		};
+		[a-z]+ => {
+			print_str "id\n";
+		};
+		[0-9]+ => {
+			print_str "num\n";
+		};
+		[0-9]+ '.' [0-9]+ => {
+			print_str "float\n";
+		};
+		'..' => {
+			print_str "range\n";
+		};
+		'.' => {
+			print_str "dot\n";
+		};
+		' ';
+	*|;
+}%%
+
+##### INPUT #####
+"if in int into i 12 1.5 3..4 5. x"
+##### OUTPUT #####
+if
+in
+int
+id
+id
+num
+float
+num
+range
+num
+num
+dot
+id
+ACCEPT
@@ -0,0 +1,47 @@
+/*
+ * @LANG: indep
+ */
+%%{
+	machine unionchain1;
+
+	action one { print_str "one\n"; }
+	action two { print_str "two\n"; }
+	action three { print_str "three\n"; }
+	action four { print_str "four\n"; }
+	action five { print_str "five\n"; }
+
+	# A chain long enough to be merged pairwise. Actions that land on the
+	# same transition must keep the order of the chain.
+	main := (
+		( 'a' [0-9] ) >one |
+		( [a-c] 'x' ) >two |
+		( 'a' any ) @three |
+		( 'b' [0-9] ) >four |
+		( [ab] [0-9] ) @five
+	) '\n';
+}%%
+
+##### INPUT #####
+"a1\n"
+"b2\n"
+"cx\n"
+"ax\n"
+"c1\n"
+##### OUTPUT #####
+one
+two
+three
+five
+ACCEPT
+two
+four
+five
+ACCEPT
+two
+ACCEPT
+one
+two
+three
+ACCEPT
+two
+FAIL
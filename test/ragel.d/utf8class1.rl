@@ -0,0 +1,120 @@
+/*
+ * @LANG: c
+ */
+
+/*
+ * The utf8_* builtins on a signed alphabet, where the lead and continuation
+ * bytes are negative keys.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+struct utf8class
+{
+	int cs;
+};
+
+%%{
+	machine utf8class;
+	variable cs fsm->cs;
+
+	word = utf8_letter utf8_alnum*;
+	number = utf8_digit+;
+
+	main := (
+		word   @{printf("word\n");} |
+		number @{printf("number\n");} |
+		utf8_upper utf8_lower+ ' ' @{printf("name\n");}
+	) utf8_space;
+}%%
+
+%% write data;
+
+void utf8class_init( struct utf8class *fsm )
+{
+	%% write init;
+}
+
+void utf8class_execute( struct utf8class *fsm, const char *data, int len )
+{
+	const char *p = data;
+	const char *pe = data+len;
+	%% write exec;
+}
+
+int utf8class_finish( struct utf8class *fsm )
+{
+	if ( fsm->cs == utf8class_error )
+		return -1;
+	else if ( fsm->cs >= utf8class_first_final )
+		return 1;
+	return 0;
+}
+
+struct utf8class fsm;
+
+void test( const char *buf )
+{
+	utf8class_init( &fsm );
+	utf8class_execute( &fsm, buf, strlen(buf) );
+	if ( utf8class_finish( &fsm ) > 0 )
+		printf("ACCEPT\n");
+	else
+		printf("FAIL\n");
+}
+
+int main()
+{
+	/* Latin, Greek and CJK letters, Devanagari digits. */
+	test( "stra\xc3\x9f" "e\n" );
+	test( "\xce\xb1\xce\xb2\xce\xb3" "1\n" );
+	test( "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x80\x80" );
+	test( "\xe0\xa5\xa7\xe0\xa5\xa8" " " );
+
+	/* Upper case then lower case, ending in an ideographic space. */
+	test( "\xc3\x89" "cole \xe3\x80\x80" );
+
+	/* A digit in the middle of a number that is not a decimal digit, a
+	 * letter in the supplementary planes, a surrogate and an overlong
+	 * encoding. */
+	test( "1\xc2\xb2" "3\n" );
+	test( "\xf0\x9d\x90\x80\n" );
+	test( "\xed\xa0\x80\n" );
+	test( "\xc1\x81\n" );
+	return 0;
+}
+
+##### OUTPUT #####
+word
+word
+word
+word
+word
+word
+ACCEPT
+word
+word
+word
+word
+ACCEPT
+word
+word
+word
+ACCEPT
+number
+number
+ACCEPT
+word
+word
+word
+word
+word
+name
+ACCEPT
+number
+FAIL
+word
+ACCEPT
+FAIL
+FAIL
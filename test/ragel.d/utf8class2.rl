@@ -0,0 +1,76 @@
+/*
+ * @LANG: c
+ */
+
+/*
+ * A definition named after a utf8_* builtin replaces it. References made
+ * before the definition keep the builtin.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+struct utf8class
+{
+	int cs;
+};
+
+%%{
+	machine utf8class;
+	variable cs fsm->cs;
+
+	first = utf8_letter;
+	utf8_letter = 'x';
+
+	main := first '-' utf8_letter '\n';
+}%%
+
+%% write data;
+
+void utf8class_init( struct utf8class *fsm )
+{
+	%% write init;
+}
+
+void utf8class_execute( struct utf8class *fsm, const char *data, int len )
+{
+	const char *p = data;
+	const char *pe = data+len;
+	%% write exec;
+}
+
+int utf8class_finish( struct utf8class *fsm )
+{
+	if ( fsm->cs == utf8class_error )
+		return -1;
+	else if ( fsm->cs >= utf8class_first_final )
+		return 1;
+	return 0;
+}
+
+struct utf8class fsm;
+
+void test( const char *buf )
+{
+	utf8class_init( &fsm );
+	utf8class_execute( &fsm, buf, strlen(buf) );
+	if ( utf8class_finish( &fsm ) > 0 )
+		printf("ACCEPT\n");
+	else
+		printf("FAIL\n");
+}
+
+int main()
+{
+	test( "\xc3\xa9-x\n" );
+	test( "a-x\n" );
+	test( "x-\xc3\xa9\n" );
+	test( "x-a\n" );
+	return 0;
+}
+
+##### OUTPUT #####
+ACCEPT
+ACCEPT
+FAIL
+FAIL